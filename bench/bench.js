@@ -65,6 +65,13 @@ for (var pass = 1; pass <= 100; pass++) {
 
 	check(r1, r3);
 
+	// mapped file, the raw bytes are not read into a buffer
+	var r6 = test("I-JSON parseFile", function(path) {
+		return ijson.parseFile(path);
+	}, __dirname + '/big.json');
+
+	check(r1, r6);
+
 	try {
 		var jsonparse = require('jsonparse');
 		var r4 = test("jsonparse single chunk", function(data) {
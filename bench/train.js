@@ -0,0 +1,62 @@
+"use strict";
+// Training run for profile guided builds (npm run build:pgo).
+// Exercises the parser on the benchmark corpus (bench/big.json, if present) and on synthetic
+// documents which cover the main shapes: records, numbers, long strings, escapes and deep nesting.
+var fs = require('fs');
+var ijson = require('../index');
+
+function records(n) {
+	var arr = [];
+	for (var i = 0; i < n; i++) arr.push({
+		id: i,
+		name: "item " + i,
+		price: i * 1.25,
+		tags: ["a", "b\tc", "€"],
+		active: i % 2 === 0,
+		parent: null
+	});
+	return arr;
+}
+
+function numbers(n) {
+	var arr = [];
+	for (var i = 0; i < n; i++) arr.push(Math.random() * 1e6 - 5e5, i, -i, 6.02e23 * Math.random());
+	return arr;
+}
+
+function strings(n) {
+	var arr = [];
+	for (var i = 0; i < n; i++) arr.push(new Array(i % 200 + 2).join("lorem ipsum dolor \"sit\" amet\\ "));
+	return arr;
+}
+
+function nested(depth) {
+	var val = { leaf: [1, 2, 3] };
+	for (var i = 0; i < depth; i++) val = { child: val, list: [val.leaf, i] };
+	return val;
+}
+
+var corpus = [records(20000), numbers(50000), strings(2000), nested(200)].map(function(val, i) {
+	return new Buffer(JSON.stringify(val, null, i % 2 ? '\t' : undefined), 'utf8');
+});
+try {
+	corpus.push(fs.readFileSync(__dirname + '/big.json'));
+} catch (ex) {
+	console.log("bench/big.json not found, training on synthetic documents only");
+}
+
+function parse(data, chunk) {
+	var parser = ijson.createParser();
+	for (var pos = 0; pos < data.length; pos += chunk) parser.update(data.slice(pos, pos + chunk));
+	return parser.result();
+}
+
+var t0 = Date.now();
+for (var pass = 0; pass < 5; pass++) {
+	corpus.forEach(function(data) {
+		parse(data, data.length);
+		parse(data, 8192);
+		parse(data, 61);
+	});
+}
+console.log("training done in " + (Date.now() - t0) + " ms");
@@ -1,4 +1,17 @@
 {
+	'variables': {
+		# node-gyp rebuild --ijson_trace=1 compiles in per-state counters and timers (parser.trace())
+		'ijson_trace%': 0,
+		# node-gyp rebuild --ijson_usdt=1 compiles in USDT probes (needs sys/sdt.h)
+		'ijson_usdt%': 0,
+		# node-gyp rebuild --ijson_build=<variant>
+		#   release: -O3 (default)
+		#   lto: -O3 with link time optimization
+		#   pgo-gen: lto build which writes profiles to ijson_profile_dir (see bench/train.js)
+		#   pgo-use: lto build optimized with the profiles of a pgo-gen run
+		'ijson_build%': 'release',
+		'ijson_profile_dir%': '<(module_root_dir)/pgo',
+	},
 	'targets': [
 		{
 			'target_name': 'ijson_bindings',
@@ -8,7 +21,58 @@
 			'sources': [
 				'src/parser.cc',
 			],
-			'cflags!': ['-ansi' '-O3'],
+			# zlib (inflate option) is the one bundled with node: its headers ship with the node headers
+			# and its symbols are resolved from the node binary, so there is nothing to link.
+			# SIMD kernels are compiled with target attributes and selected at load time (src/simd.h)
+			# so no -m flags here: the same binary runs on any x86-64.
+			'cflags!': ['-ansi', '-O2'],
+			'cflags_cc!': ['-ansi', '-O2'],
+			'cflags': ['-O3'],
+			'xcode_settings': {
+				'GCC_OPTIMIZATION_LEVEL': '3',
+			},
+			'msvs_settings': {
+				'VCCLCompilerTool': {
+					'Optimization': 2,
+				},
+			},
+			'conditions': [
+				['ijson_trace==1', {
+					'defines': ['IJSON_TRACE'],
+				}],
+				['ijson_usdt==1', {
+					'defines': ['IJSON_USDT'],
+				}],
+				['ijson_build not in ("release", "lto", "pgo-gen", "pgo-use")', {
+					# a typo must not silently build some other variant: fail the configure step
+					'variables': {
+						'ijson_build_invalid': '<!(echo "unknown ijson_build <(ijson_build): expected release, lto, pgo-gen or pgo-use" 1>&2 && exit 1)',
+					},
+				}],
+				['ijson_build in ("lto", "pgo-gen", "pgo-use")', {
+					'cflags': ['-flto'],
+					'ldflags': ['-O3', '-flto'],
+					'xcode_settings': {
+						'LLVM_LTO': 'YES',
+					},
+					'msvs_settings': {
+						'VCCLCompilerTool': {
+							'WholeProgramOptimization': 'true',
+						},
+						'VCLinkerTool': {
+							'LinkTimeCodeGeneration': 1,
+						},
+					},
+				}],
+				['ijson_build=="pgo-gen"', {
+					'cflags': ['-fprofile-generate=<(ijson_profile_dir)'],
+					'ldflags': ['-fprofile-generate=<(ijson_profile_dir)'],
+				}],
+				['ijson_build=="pgo-use"', {
+					'cflags': ['-fprofile-use=<(ijson_profile_dir)', '-fprofile-correction', '-Wno-missing-profile'],
+					'ldflags': ['-fprofile-use=<(ijson_profile_dir)', '-fprofile-correction'],
+				}],
+			],
 		},
 	],
 }
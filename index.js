@@ -1,16 +1,116 @@
 "use strict";
 
+var pointer = require('./lib/pointer');
+
+var Parser, Index, Serializer, parseMany;
 try {
 	var nat = require('./build/Release/ijson_bindings');
-	nat.Parser.prototype.update = function(arg) {
-		if (typeof arg == "string") return this._update(new Buffer(arg, 'utf8'));
-		else return this._update(arg);
+	// strings are scanned natively, without conversion to Buffer
+	nat.Parser.prototype.update = function(arg, start) {
+		return this._update(arg, start);
+	}
+	Parser = nat.Parser;
+	parseMany = nat.parseMany;
+	Serializer = nat.Serializer;
+	// the native index only holds offsets, the addressed value is parsed from its slice of the buffer
+	Index = function(buffer, Parser, options) {
+		this.index = new nat.Index(buffer);
+		this.buffer = buffer;
+		this.options = options;
+	}
+	Index.prototype.get = function(ptr) {
+		var range = this.index._range(pointer.tokens(ptr));
+		if (!range) return undefined;
+		var parser = new Parser(undefined, undefined, this.options);
+		parser.update(this.buffer.slice(range[0], range[1]));
+		return parser.result();
 	}
-	exports.createParser = function(cb, depth) {
-		var p = new nat.Parser(cb, depth);
-		return p;
-	};
 } catch (ex) {
 	console.log("cannot load C++ parser, using JS implementation");
-	exports.createParser = require('./lib/parser').createParser;
-}
\ No newline at end of file
+	Parser = require('./lib/parser').Parser;
+	parseMany = require('./lib/parser').parseMany;
+	Index = pointer.Index;
+	Serializer = require('./lib/serializer').Serializer;
+}
+
+exports.createParser = function(cb, depth, options) {
+	return new Parser(cb, depth, options || {});
+};
+
+// checks syntax and UTF-8 encoding without building any value.
+// returns true if data (buffer or string) is a single valid JSON document, false otherwise.
+exports.validate = function(data) {
+	var p = new Parser(undefined, undefined, { validateOnly: true });
+	try {
+		p.update(data);
+		return p.result();
+	} catch (ex) {
+		return false;
+	}
+};
+
+// parses a file without reading it into a buffer first.
+// Use parser.updateFile(path) to get callbacks instead of a result.
+exports.parseFile = function(path, options) {
+	var parser = new Parser(undefined, undefined, options || {});
+	parser.updateFile(path);
+	return parser.result();
+};
+
+// parses an array of small documents (buffers or strings) in a single call.
+// returns an array of values, with an Error in place of the documents which cannot be parsed.
+exports.parseMany = function(inputs, options) {
+	return parseMany(inputs, options || {});
+};
+
+// parsers which are reset and reused across documents.
+// At most max parsers (default 16) are kept idle.
+function Pool(cb, depth, options, max) {
+	this.cb = cb;
+	this.depth = depth;
+	this.options = options;
+	this.max = max || 16;
+	this.idle = [];
+}
+
+Pool.prototype.acquire = function() {
+	return this.idle.pop() || new Parser(this.cb, this.depth, this.options);
+};
+
+Pool.prototype.release = function(parser) {
+	parser.reset();
+	if (this.idle.length < this.max) this.idle.push(parser);
+};
+
+// parses a complete document (buffer or string) with a pooled parser
+Pool.prototype.parse = function(data) {
+	var parser = this.acquire();
+	try {
+		parser.update(data);
+		return parser.result();
+	} finally {
+		this.release(parser);
+	}
+};
+
+exports.createPool = function(cb, depth, options, max) {
+	return new Pool(cb, depth, options || {}, max);
+};
+
+// serializes value in chunks: serializer.next(maxBytes) returns a buffer, null at the end.
+exports.createSerializer = function(value) {
+	return new Serializer(value);
+};
+
+// the indexed buffer holds one plain document: the input options do not apply to its values
+var inputOptions = ['ndjson', 'inflate', 'coalesce', 'coalesceDelay', 'pauseAfter', 'pauseDepth'];
+
+// indexes buffer once for repeated JSON pointer lookups: index.get('/a/b/0').
+// options are the parser options used to build the values.
+exports.index = function(buffer, options) {
+	var valueOptions = {};
+	Object.keys(options || {}).forEach(function(name) {
+		if (inputOptions.indexOf(name) < 0) valueOptions[name] = options[name];
+	});
+	return new Index(buffer, Parser, valueOptions);
+};
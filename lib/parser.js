@@ -2,6 +2,10 @@
  * Copyright (c) 2014 Bruno Jouhier <bjouhier@gmail.com>
  * MIT License
  */
+var fs = require('fs');
+var zlib = require('zlib');
+var pointer = require('./pointer');
+
 var classes = [];
 var lastClass = 0;
 
@@ -40,7 +44,8 @@ var CURLY_OPEN = makeClass('{'),
 	DIGIT = makeClass('0123456789'),
 	DOT = makeClass('.'),
 	E_ = makeClass('E'),
-	HEX_REMAIN = makeClass('ABCDFcd');
+	HEX_REMAIN = makeClass('ABCDFcd'),
+	CTRL = makeClass('\x00\x01\x02\x03\x04\x05\x06\x07\x08\x0b\x0c\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f');
 
 for (var i = 0; i < 0x80; i++) {
 	if (classes[i] == null) classes[i] = lastClass;
@@ -73,6 +78,8 @@ function literalOpen(val) {
 		}
 	}
 	var fn = function(parser, pos, cla) {
+			if (val === null) parser._stats.nulls++;
+			else parser._stats.booleans++;
 			parser.frame.setValue(val);
 			return AFTER_VALUE;
 		};
@@ -84,6 +91,7 @@ function literalOpen(val) {
 
 function escapeOpen(parser, pos) {
 	parser.keep.push(parser.data.slice(parser.beg, pos));
+	parser._stats.bytesCopied += pos - parser.beg;
 	parser.beg = -1;
 	return AFTER_ESCAPE;
 }
@@ -165,13 +173,19 @@ var AFTER_KEY = makeState([
 	[NL, eatNL]
 ], error);
 
-// string states
+// string states. Control chars must be escaped: tab and CR are in the SPACE class
 var INSIDE_QUOTES = makeState([
 	[DQUOTE, stringClose],
 	[BSLASH, escapeOpen],
-	[NL, error]
+	[SPACE, quotedSpace],
+	[NL, error],
+	[CTRL, error]
 ], null);
 
+function quotedSpace(parser, pos, cla, state) {
+	return parser.data[pos] === 0x20 ? state : error(parser, pos);
+}
+
 var AFTER_ESCAPE = makeState([
 	[b_, escapeLetter('\b')],
 	[f_, escapeLetter('\f')],
@@ -183,7 +197,18 @@ var AFTER_ESCAPE = makeState([
 	[u_, escapeUnicode()]
 ], error);
 
-// number transition - a bit loose, let parse handle errors
+// number states, following the JSON grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+var AFTER_MINUS = makeState([
+	[DIGIT, integerOpen]
+], error);
+
+var AFTER_ZERO = makeState([
+	[DIGIT, error],
+	[DOT, doubleOpen],
+	[e_, expOpen],
+	[E_, expOpen]
+], numberClose);
+
 var INSIDE_NUMBER = makeState([
 	[DIGIT, null],
 	[DOT, doubleOpen],
@@ -191,15 +216,27 @@ var INSIDE_NUMBER = makeState([
 	[E_, expOpen]
 ], numberClose);
 
+var AFTER_DOT = makeState([
+	[DIGIT, fractionOpen]
+], error);
+
 var INSIDE_DOUBLE = makeState([
 	[DIGIT, null],
 	[e_, expOpen],
 	[E_, expOpen]
 ], numberClose);
 
+var AFTER_E = makeState([
+	[PLUS, expSign],
+	[MINUS, expSign],
+	[DIGIT, expDigits]
+], error);
+
+var AFTER_EXP_SIGN = makeState([
+	[DIGIT, expDigits]
+], error);
+
 var INSIDE_EXP = makeState([
-	[PLUS, null],
-	[MINUS, null],
 	[DIGIT, null]
 ], numberClose);
 
@@ -211,6 +248,8 @@ function Frame(parser, result, key, prev, isArray) {
 	this.arrayPos = isArray ? 0 : -1;
 	this.needsValue = false;
 	this.depth = prev ? prev.depth + 1 : 0;
+	this.numeric = false; // typedArrays option: all elements are numbers so far
+	this.ints = false; // ... and all are integer literals that fit in an int32
 }
 
 Frame.prototype.pushPath = function(path) {
@@ -223,10 +262,42 @@ Frame.prototype.pushPath = function(path) {
 Frame.prototype.setValue = function(val) {
 	//console.log("setValue: key=" + this.key + ", value=" + val);
 	this.needsValue = false;
+	var parser = this.parser;
+	if (!this.prev && parser.ndjson) markValue(parser, this);
+	if (parser.pauseAfter && this.depth === parser.pauseDepth && --parser.pauseLeft === 0) {
+		parser.pauseLeft = parser.pauseAfter;
+		parser.paused = true;
+	}
+	if (this.parser.validateOnly) {
+		if (this.arrayPos >= 0) this.arrayPos++;
+		else this.key = null;
+		return;
+	}
+	var selected = null;
+	if (parser.transforms) {
+		var path = [];
+		this.pushPath(path);
+		selected = parser.transforms.select(path);
+		if (typeof val === 'string') {
+			val = parser.transforms.convert(parser, selected, val);
+		} else if (val === null && this.arrayPos < 0 && selected.dropNull) {
+			parser._stats.transformed++;
+			this.key = null;
+			return;
+		}
+	}
+	if (this.numeric) {
+		if (typeof val !== 'number') this.numeric = false;
+		else if (this.ints && (this.parser.isDouble || (val | 0) !== val || (val === 0 && 1 / val < 0))) this.ints = false;
+	}
 	if (this.parser.callback && this.depth <= this.parser.callbackDepth) {
 		var path = [];
 		this.parser.frame.pushPath(path);
+		var t0 = process.hrtime();
 		val = this.parser.callback(val, path);
+		var dt = process.hrtime(t0);
+		this.parser._stats.callbacks++;
+		this.parser._stats.callbackTime += dt[0] * 1e3 + dt[1] / 1e6;
 		if (val === undefined) {
 			if (this.arrayPos >= 0) this.arrayPos++;
 			else this.key = null;
@@ -236,36 +307,140 @@ Frame.prototype.setValue = function(val) {
 	if (this.arrayPos >= 0) {
 		this.result.push(val);
 		this.arrayPos++;
+	} else if (selected && selected.rename !== undefined) {
+		parser._stats.transformed++;
+		this.result[selected.rename] = val;
+		this.key = null;
 	} else {
 		this.result[this.key] = val;
 		this.key = null;
 	}
 }
 
-function numberOpen(parser, pos) {
+// transforms option: same rules as the C++ parser, matched against the path of every value
+function Transforms(rules) {
+	this.rules = [];
+	this.reshapes = false; // dropNull or rename rules, which disable the columnar option
+	for (var i = 0; i < rules.length && this.rules.length < 32; i++) {
+		var rule = rules[i];
+		if (rule === null || typeof rule !== 'object') continue;
+		var path = typeof rule.path === 'string' ? rule.path : null;
+		if (path !== null && path !== '' && path[0] !== '/') continue;
+		var tokens = path !== null ? pointer.tokens(path) : null;
+		var rename = tokens && typeof rule.rename === 'string' ? rule.rename : undefined;
+		this.rules.push({
+			tokens: tokens,
+			date: !!rule.date,
+			number: !!rule.number,
+			dropNull: !!rule.dropNull,
+			rename: rename
+		});
+		if (rule.dropNull || rename !== undefined) this.reshapes = true;
+	}
+}
+
+function matchesPath(tokens, path) {
+	if (tokens.length !== path.length) return false;
+	for (var i = 0; i < tokens.length; i++) {
+		if (tokens[i] !== '*' && tokens[i] !== String(path[i])) return false;
+	}
+	return true;
+}
+
+Transforms.prototype.select = function(path) {
+	var selected = { date: false, number: false, dropNull: false, rename: undefined };
+	this.rules.forEach(function(rule) {
+		if (rule.tokens && !matchesPath(rule.tokens, path)) return;
+		selected.date = selected.date || rule.date;
+		selected.number = selected.number || rule.number;
+		selected.dropNull = selected.dropNull || rule.dropNull;
+		if (selected.rename === undefined) selected.rename = rule.rename;
+	});
+	return selected;
+}
+
+var NUMBER = /^-?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?$/;
+var DATE = /^([0-9]{4})-([0-9]{2})-([0-9]{2})(?:T([0-9]{2}):([0-9]{2})(?::([0-9]{2})(?:\.([0-9]+))?)?(?:(Z)|([+-])([0-9]{2}):([0-9]{2})))?$/;
+var monthDays = [31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31];
+
+// ISO-8601 date, or date-time with a time zone, as ms since the epoch. undefined if str is not one.
+function parseDate(str) {
+	var m = DATE.exec(str);
+	if (!m) return undefined;
+	var y = +m[1], mo = +m[2], d = +m[3];
+	if (mo < 1 || mo > 12 || d < 1 || d > monthDays[mo - 1]) return undefined;
+	if (mo === 2 && d === 29 && (y % 4 !== 0 || (y % 100 === 0 && y % 400 !== 0))) return undefined;
+	var date = new Date(0);
+	date.setUTCFullYear(y, mo - 1, d);
+	if (m[4] === undefined) return date.getTime();
+	var h = +m[4], mi = +m[5], sec = m[6] !== undefined ? +m[6] : 0, oh = m[10] !== undefined ? +m[10] : 0, om = m[11] !== undefined ? +m[11] : 0;
+	if (h > 23 || mi > 59 || sec > 59 || oh > 23 || om > 59) return undefined;
+	date.setUTCHours(h, mi, sec, m[7] !== undefined ? +(m[7] + '00').substring(0, 3) : 0);
+	return date.getTime() - (m[9] === '-' ? -1 : 1) * (oh * 60 + om) * 60000;
+}
+
+// number and date transforms of a string value. Only short ASCII strings are converted.
+Transforms.prototype.convert = function(parser, selected, str) {
+	if (!(selected.number || selected.date) || str.length >= 64 || !/^[\x00-\x7f]*$/.test(str)) return str;
+	if (selected.number && NUMBER.test(str)) {
+		parser._stats.transformed++;
+		parser.isDouble = !/^-?[0-9]+$/.test(str);
+		return +str;
+	}
+	var ms = selected.date ? parseDate(str) : undefined;
+	if (ms === undefined) return str;
+	parser._stats.transformed++;
+	return new Date(ms);
+}
+
+function numberOpen(parser, pos, cla) {
 	parser.isDouble = false;
 	parser.beg = pos;
-	return INSIDE_NUMBER;
+	return cla === MINUS ? AFTER_MINUS : integerOpen(parser, pos);
+}
+
+// the integer part has no leading zero
+function integerOpen(parser, pos) {
+	return parser.data[pos] === 0x30 ? AFTER_ZERO : INSIDE_NUMBER;
 }
 
 function doubleOpen(parser, pos) {
 	parser.isDouble = true;
+	return AFTER_DOT;
+}
+
+function fractionOpen(parser, pos) {
 	return INSIDE_DOUBLE;
 }
 
 function expOpen(parser, pos) {
 	parser.isDouble = true;
+	return AFTER_E;
+}
+
+function expSign(parser, pos) {
+	return AFTER_EXP_SIGN;
+}
+
+function expDigits(parser, pos) {
 	return INSIDE_EXP;
 }
 
 function numberClose(parser, pos, cla) {
-	var str = parser.data.toString('utf8', parser.beg, pos);
-	parser.beg = -1;
-	if (parser.keep.length !== 0) {
-		str = Buffer.concat(parser.keep).toString('utf8') + str;
-		parser.keep = [];		
+	parser._stats.numbers++;
+	if (parser.validateOnly) {
+		parser.beg = -1;
+		parser.keep = [];
+		parser.frame.setValue();
+	} else {
+		var str = parser.data.toString('utf8', parser.beg, pos);
+		parser.beg = -1;
+		if (parser.keep.length !== 0) {
+			str = Buffer.concat(parser.keep).toString('utf8') + str;
+			parser.keep = [];
+		}
+		parser.frame.setValue(parser.isDouble ? parseFloat(str) : parseInt(str, 10));
 	}
-	parser.frame.setValue(parser.isDouble ? parseFloat(str) : parseInt(str, 10));
 	var fn = AFTER_VALUE[cla];
 	return fn ? fn(parser, pos, cla, AFTER_VALUE) : AFTER_VALUE;
 }
@@ -276,41 +451,88 @@ function stringOpen(parser, pos) {
 }
 
 function stringClose(parser, pos) {
-	var val = parser.data.toString('utf8', parser.beg, pos);
-	parser.beg = -1;
-	if (parser.keep.length !== 0) {
-		val = Buffer.concat(parser.keep).toString('utf8') + val;
+	var val = "";
+	if (parser.validateOnly) {
 		parser.keep = [];
+	} else {
+		val = parser.data.toString('utf8', parser.beg, pos);
+		if (parser.keep.length !== 0) {
+			val = Buffer.concat(parser.keep).toString('utf8') + val;
+			parser.keep = [];
+		}
 	}
+	parser.beg = -1;
 	var frame = parser.frame;
 	if (frame.key === null && frame.arrayPos === -1) {
 		frame.key = val;
 		return AFTER_KEY;
 	} else {
+		parser._stats.strings++;
 		frame.setValue(val);
 		return AFTER_VALUE;
 	}
 }
 
 function arrayOpen(parser, pos) {
-	parser.frame = new Frame(parser, [], null, parser.frame, true);
+	parser.frame = new Frame(parser, parser.validateOnly ? null : [], null, parser.frame, true);
     parser.frame.needsValue = false;
+	// elements that go through the callback are never converted
+	parser.frame.numeric = parser.typedArrays && !parser.validateOnly && (!parser.callback || parser.frame.depth > parser.callbackDepth);
+	parser.frame.ints = true;
+	parser._stats.arrays++;
+	if (parser.frame.depth > parser._stats.maxDepth) parser._stats.maxDepth = parser.frame.depth;
 	return BEFORE_VALUE;
 }
 
 function arrayClose(parser, pos) {
     if (parser.frame.arrayPos == -1) return error(parser, pos);
     if (parser.frame.needsValue) return error(parser, pos);
+    if (!parser.frame.prev) return error(parser, pos);
 	var val = parser.frame.result;
+	if (parser.frame.numeric && val.length > 0) val = parser.frame.ints ? new Int32Array(val) : new Float64Array(val);
+	else if (parser.columnar && parser.frame.depth === 1 && !parser.validateOnly && (!parser.callback || parser.callbackDepth < 1) &&
+		!(parser.transforms && parser.transforms.reshapes)) val = toColumns(val);
 	parser.frame = parser.frame.prev;
-    if (!parser.frame) return error(parser, pos);
 	parser.frame.setValue(val);
 	return AFTER_VALUE;
 }
 
+function isRecord(val) {
+	return val !== null && typeof val === 'object' && !Array.isArray(val);
+}
+
+// columnar option: turns an array of records with the same keys (in the same order) into an object of columns.
+// Returns the array unchanged if the records do not all have the same shape.
+function toColumns(rows) {
+	if (rows.length === 0 || !isRecord(rows[0])) return rows;
+	var keys = Object.keys(rows[0]);
+	if (keys.length === 0) return rows;
+	for (var i = 1; i < rows.length; i++) {
+		if (!isRecord(rows[i])) return rows;
+		var k = Object.keys(rows[i]);
+		if (k.length !== keys.length) return rows;
+		for (var j = 0; j < k.length; j++) if (k[j] !== keys[j]) return rows;
+	}
+	var columns = {};
+	keys.forEach(function(key) {
+		var column = rows.map(function(row) {
+			return row[key];
+		});
+		var numeric = true, ints = true;
+		column.forEach(function(val) {
+			if (typeof val !== 'number') numeric = false;
+			else if ((val | 0) !== val || (val === 0 && 1 / val < 0)) ints = false;
+		});
+		columns[key] = numeric ? (ints ? new Int32Array(column) : new Float64Array(column)) : column;
+	});
+	return columns;
+}
+
 function objectOpen(parser, pos) {
-	parser.frame = new Frame(parser, {}, null, parser.frame, false);
+	parser.frame = new Frame(parser, parser.validateOnly ? null : {}, null, parser.frame, false);
     parser.frame.needsValue = false;
+	parser._stats.objects++;
+	if (parser.frame.depth > parser._stats.maxDepth) parser._stats.maxDepth = parser.frame.depth;
 	return BEFORE_KEY;
 }
 
@@ -336,31 +558,159 @@ function eatComma(parser, pos) {
 
 function eatNL(parser, pos, cla, state) {
 	parser.line++;
+	// ndjson mode: a newline ends a top-level value, or the line being skipped
+	if (parser.ndjson && !parser.frame.prev) {
+		parser.lineStart = parser.line;
+		return BEFORE_VALUE;
+	}
 	return state;
 }
 
+// ndjson mode: rest of a line with a syntax error
+var SKIP_LINE = makeState([
+	[NL, eatNL]
+], null);
+
 function error(parser, pos) {
 	var near = parser.data.toString('utf8', pos, pos + 10);
 	near = near.split('\n')[0];
-	throw new Error("line " + parser.line + ": syntax error near " + near);
+	var message = "line " + parser.line + ": syntax error near " + near;
+	if (!parser.ndjson) throw new Error(message);
+	skipError(parser, message, pos);
+	// the error may be the newline itself (inside a string)
+	return parser.data[pos] === 0x0a ? eatNL(parser, pos, NL, BEFORE_VALUE) : SKIP_LINE;
+}
+
+// ndjson mode: records the error and drops the values being parsed
+function skipError(parser, message, pos) {
+	if (parser.errorList.length < 1000) parser.errorList.push({ message: message, line: parser.line, offset: parser._stats.bytes - parser.docStart + pos });
+	parser._stats.syntaxErrors++;
+	while (parser.frame.prev) parser.frame = parser.frame.prev;
+	parser.frame.needsValue = false;
+	parser.keep = [];
+	parser.beg = -1;
+	// values which the line completed before the error. The callback has already seen them.
+	if (parser.mark.line === parser.lineStart) {
+		if (!parser.validateOnly) parser.frame.result.length = parser.mark.length;
+		parser.frame.arrayPos = parser.mark.arrayPos;
+		parser.mark.line = 0;
+	}
+}
+
+// ndjson mode: the first top-level value of a line marks the root array, to drop the line if it has an error
+function markValue(parser, root) {
+	if (parser.mark.line === parser.lineStart) return;
+	parser.mark.line = parser.lineStart;
+	parser.mark.length = parser.validateOnly ? 0 : root.result.length;
+	parser.mark.arrayPos = root.arrayPos;
 }
 
-function Parser(callback, callbackDepth) {
+// Incremental UTF-8 check, same rules as the C++ validator (no overlongs, no surrogates, max U+10FFFF).
+function Utf8Validator() {
+	this.needs = 0; // number of continuation bytes still expected
+	this.lo = 0x80; // range of the next continuation byte
+	this.hi = 0xbf;
+}
+
+Utf8Validator.prototype.update = function(buf) {
+	for (var i = 0, len = buf.length; i < len; i++) {
+		var ch = buf[i];
+		if (this.needs > 0) {
+			if (ch < this.lo || ch > this.hi) return false;
+			this.lo = 0x80;
+			this.hi = 0xbf;
+			this.needs--;
+		} else if (ch >= 0x80) {
+			if (ch < 0xc2) return false;
+			if (ch < 0xe0) this.needs = 1;
+			else if (ch < 0xf0) {
+				this.needs = 2;
+				if (ch === 0xe0) this.lo = 0xa0;
+				else if (ch === 0xed) this.hi = 0x9f;
+			} else if (ch < 0xf5) {
+				this.needs = 3;
+				if (ch === 0xf0) this.lo = 0x90;
+				else if (ch === 0xf4) this.hi = 0x8f;
+			} else return false;
+		}
+	}
+	return true;
+}
+
+function Parser(callback, callbackDepth, options) {
+	options = options || {};
+	this.callback = callback;
+	this.callbackDepth = callbackDepth != null ? callbackDepth : 0x7fffffff;
+	this._stats = new Stats();
+	this.validateOnly = !!options.validateOnly;
+	this.typedArrays = !!options.typedArrays;
+	this.columnar = !!options.columnar;
+	this.inflate = options.inflate === 'raw' ? zlib.inflateRawSync : options.inflate ? zlib.unzipSync : null;
+	this.pauseAfter = options.pauseAfter > 0 && !this.validateOnly ? options.pauseAfter | 0 : 0;
+	this.pauseDepth = typeof options.pauseDepth === 'number' ? options.pauseDepth : 1;
+	this.transforms = Array.isArray(options.transforms) ? new Transforms(options.transforms) : null;
+	this.ndjson = !!options.ndjson;
+	this.reset();
+}
+
+// gets ready for a new document. Callback, options and stats are kept.
+Parser.prototype.reset = function() {
 	this.frame = new Frame(this, [], null, null, true);
 	this.line = 1;
+	this.lineStart = 1; // ndjson mode: line where the current top-level line started, a value may span several lines
+	this.mark = { line: 0, length: 0, arrayPos: 0 };
 	this.keep = [];
+	this.surrogate = ''; // high surrogate which ended the last string chunk
 	this.isDouble = false;
 	this.unicode = 0;
 	this.beg = -1;
 	this.state = BEFORE_VALUE;
-	this.callback = callback;
-	this.callbackDepth = callbackDepth != null ? callbackDepth : 0x7fffffff;
+	this.utf8 = this.validateOnly ? new Utf8Validator() : null;
+	this.compressed = [];
+	this.pauseLeft = this.pauseAfter;
+	this.paused = false;
+	this.errorList = [];
+	this.docStart = this._stats.bytes;
 }
 
-function parse(parser, str, state) {
+// stops the current update after the value being parsed
+Parser.prototype.pause = function() {
+	if (!this.validateOnly) this.paused = true;
+}
+
+// Same counters as the C++ parser. There are no string caches in the JS implementation.
+function Stats() {
+	this.bytes = 0;
+	this.objects = 0;
+	this.arrays = 0;
+	this.strings = 0;
+	this.numbers = 0;
+	this.booleans = 0;
+	this.nulls = 0;
+	this.keyHits = 0;
+	this.keyMisses = 0;
+	this.valueHits = 0;
+	this.valueMisses = 0;
+	this.splitTokens = 0;
+	this.bytesCopied = 0;
+	this.maxDepth = 0;
+	this.callbacks = 0;
+	this.callbackTime = 0;
+	this.externalStrings = 0;
+	this.coalesced = 0;
+	this.compressedBytes = 0;
+	this.keyPredictions = 0;
+	this.transformed = 0;
+	this.syntaxErrors = 0;
+}
+
+// returns the number of bytes consumed: all of them, unless the parser paused
+function parse(parser, str) {
 	var pos = 0,
-		len = str.length;
-	while (pos < len) {
+		len = str.length,
+		state = parser.state;
+	parser.paused = false;
+	while (pos < len && !parser.paused) {
 		var ch = str[pos];
 		var cla = (ch < 0x80) ? classes[ch] : lastClass;
 		var fn = state[cla];
@@ -368,28 +718,154 @@ function parse(parser, str, state) {
 		if (fn !== null) state = fn(parser, pos, cla, state);
 		pos++;
 	}
-	return state;	
+	parser.state = state;
+	return pos;
 }
 
-Parser.prototype.update = function(str) {
-	if (typeof str === "string") str = new Buffer(str, 'utf8');
+// parses str from start (default 0). Returns the offset reached: the end of str, unless the parser paused.
+// Offsets are in chars for strings.
+Parser.prototype.update = function(str, start) {
+	if (start !== undefined && (typeof start !== 'number' || start < 0 || start > str.length)) throw new Error("bad arg 2: offset expected");
+	start = start | 0;
+	if (this.inflate) {
+		// zlib has no synchronous streaming API: compressed chunks are inflated and parsed by result()
+		if (!Buffer.isBuffer(str)) throw new Error("bad arg 1: buffer expected");
+		if (start) str = str.slice(start);
+		this.compressed.push(str);
+		this._stats.compressedBytes += str.length;
+		return start + str.length;
+	}
+	var chars = null, held = this.surrogate;
+	if (typeof str === "string") {
+		chars = start ? str.substring(start) : str;
+		var text = held + chars;
+		// a surrogate pair may be split across chunks: a trailing high surrogate waits for the next chunk
+		var last = text.charCodeAt(text.length - 1);
+		this.surrogate = last >= 0xd800 && last < 0xdc00 ? text[text.length - 1] : '';
+		str = new Buffer(this.surrogate ? text.substring(0, text.length - 1) : text, 'utf8');
+	} else {
+		if (held) this.flushSurrogate();
+		if (start) str = str.slice(start);
+		if (this.utf8 && !this.utf8.update(str)) throw new Error("invalid UTF-8 sequence");
+	}
 	this.data = str;
-	this.state = parse(this, str, this.state);
+	var pos = parse(this, str);
+	this._stats.bytes += pos;
 	if (this.beg !== -1) {
 		this.keep.push(this.data.slice(this.beg));
+		this._stats.bytesCopied += str.length - this.beg;
 		this.beg = 0;
 	}
+	if (this.keep.length !== 0) this._stats.splitTokens++;
+	if (chars === null) return start + pos;
+	if (pos === str.length) return start + chars.length;
+	// paused: the rest of the chunk, with its trailing high surrogate, will be passed again
+	this.surrogate = '';
+	return start + Math.max(0, str.toString('utf8', 0, pos).length - held.length);
+}
+
+Parser.prototype.flushSurrogate = function() {
+	var held = this.surrogate;
+	this.surrogate = '';
+	for (var data = new Buffer(held, 'utf8'), pos = 0; pos < data.length; pos = this.update(data, pos));
+}
+
+// parses a file in 1 MB chunks. Split tokens keep references to their chunk, so every chunk gets a new buffer.
+Parser.prototype.updateFile = function(path) {
+	var fd = fs.openSync(path, 'r');
+	try {
+		for (;;) {
+			var chunk = new Buffer(1 << 20);
+			var len = fs.readSync(fd, chunk, 0, chunk.length, null);
+			if (len === 0) break;
+			chunk = len < chunk.length ? chunk.slice(0, len) : chunk;
+			// pauses are ignored
+			for (var pos = 0; pos < len; pos = this.update(chunk, pos));
+		}
+	} finally {
+		fs.closeSync(fd);
+	}
 }
 
 Parser.prototype.result = function() {
-	if (this.frame.prev) throw new Error("Unexpected end of input");
-	if (this.frame.result.length > 1) throw new Error("Too many results: " + this.frame.result.length);
+	if (this.inflate) {
+		var inflate = this.inflate;
+		this.inflate = null;
+		try {
+			var data = inflate(Buffer.concat(this.compressed));
+			// pauses are ignored
+			for (var pos = 0; pos < data.length; pos = this.update(data, pos));
+		} catch (ex) {
+			if (ex.code === 'Z_BUF_ERROR') throw new Error("Unexpected end of compressed input");
+			if (ex.code === 'Z_DATA_ERROR') throw new Error("invalid compressed input: " + ex.message);
+			throw ex;
+		} finally {
+			this.inflate = inflate;
+			this.compressed = [];
+		}
+	}
+	if (this.surrogate) this.flushSurrogate();
+	if (this.frame.prev && !this.ndjson) throw new Error("Unexpected end of input");
 	// number values are only closed when we read past them. So we parse an extra space if still inside a number.
-	if (this.state === INSIDE_NUMBER || this.state === INSIDE_DOUBLE || this.state === INSIDE_EXP) this.update(' ');
+	if (!this.frame.prev && (this.state === INSIDE_NUMBER || this.state === AFTER_ZERO ||
+		this.state === INSIDE_DOUBLE || this.state === INSIDE_EXP)) {
+		this.update(' ');
+		this._stats.bytes--; // the extra space is not part of the input
+	}
+	if (this.ndjson) {
+		// the last line may end without a newline, or be cut
+		if (this.frame.prev || !(this.state === AFTER_VALUE || this.state === SKIP_LINE || (this.state === BEFORE_VALUE && !this.frame.needsValue))) {
+			skipError(this, "Unexpected end of input", 0);
+			this.state = BEFORE_VALUE;
+		}
+		return this.validateOnly || this.frame.result;
+	}
 	if (this.state !== AFTER_VALUE) throw new Error("Unexpected end of input");
+	// after the last number is closed
+	var count = this.validateOnly ? this.frame.arrayPos : this.frame.result.length;
+	if (count > 1) throw new Error("Too many results: " + count);
+	if (this.validateOnly) {
+		if (this.utf8.needs !== 0) throw new Error("invalid UTF-8 sequence");
+		return true;
+	}
 	return this.frame.result[0];
 }
 
-exports.createParser = function(callback, callbackDepth) {
-	return new Parser(callback, callbackDepth);
+// ndjson mode: the syntax errors skipped since the last call
+Parser.prototype.errors = function() {
+	var errors = this.errorList;
+	this.errorList = [];
+	return errors;
+}
+
+// chunks are never coalesced by the JS implementation
+Parser.prototype.flush = function() {}
+
+Parser.prototype.stats = function() {
+	var stats = new Stats();
+	for (var k in stats) stats[k] = this._stats[k];
+	return stats;
+}
+
+exports.Parser = Parser;
+
+// parses each buffer or string of inputs as a separate document.
+// A document which cannot be parsed gets an Error in the results.
+exports.parseMany = function(inputs, options) {
+	return inputs.map(function(input) {
+		try {
+			var parser = new Parser(undefined, undefined, options);
+			parser.pauseAfter = 0;
+			parser.update(input);
+			var result = parser.result();
+			// ndjson mode: the values of the lines, and the errors of the lines which were skipped
+			return parser.ndjson ? { values: result, errors: parser.errors() } : result;
+		} catch (ex) {
+			return ex;
+		}
+	});
+}
+
+exports.createParser = function(callback, callbackDepth, options) {
+	return new Parser(callback, callbackDepth, options);
 }
\ No newline at end of file
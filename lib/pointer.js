@@ -0,0 +1,38 @@
+"use strict";
+// JSON pointers (RFC 6901)
+
+// '/a/b~1c/0' -> ['a', 'b/c', '0']
+exports.tokens = function(pointer) {
+	if (pointer === '') return [];
+	if (typeof pointer !== 'string' || pointer[0] !== '/') throw new Error("bad JSON pointer: " + pointer);
+	return pointer.substring(1).split('/').map(function(token) {
+		return token.replace(/~1/g, '/').replace(/~0/g, '~');
+	});
+}
+
+// JS implementation of the index: the document is parsed once and the pointers are resolved on the value.
+function Index(buffer, Parser, options) {
+	var parser = new Parser(undefined, undefined, options);
+	parser.update(buffer);
+	this.value = parser.result();
+}
+
+Index.prototype.get = function(pointer) {
+	var val = this.value;
+	var tokens = exports.tokens(pointer);
+	for (var i = 0; i < tokens.length; i++) {
+		var token = tokens[i];
+		if (Array.isArray(val) || ArrayBuffer.isView(val)) {
+			if (!/^(0|[1-9][0-9]*)$/.test(token) || +token >= val.length) return undefined;
+			val = val[+token];
+		} else if (val !== null && typeof val === 'object') {
+			if (!Object.prototype.hasOwnProperty.call(val, token)) return undefined;
+			val = val[token];
+		} else {
+			return undefined;
+		}
+	}
+	return val;
+}
+
+exports.Index = Index;
@@ -0,0 +1,18 @@
+"use strict";
+// JS implementation of the serializer: the value is stringified at once and returned in slices.
+
+function Serializer(value) {
+	var str = JSON.stringify(value);
+	this.buffer = str === undefined ? null : new Buffer(str, 'utf8');
+	this.pos = 0;
+}
+
+Serializer.prototype.next = function(maxBytes) {
+	if (typeof maxBytes !== 'number' || maxBytes <= 0) throw new Error("bad arg 1: positive integer expected");
+	if (!this.buffer || this.pos >= this.buffer.length) return null;
+	var chunk = this.buffer.slice(this.pos, this.pos + maxBytes);
+	this.pos += chunk.length;
+	return chunk;
+}
+
+exports.Serializer = Serializer;
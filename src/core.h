@@ -0,0 +1,1047 @@
+/**
+ * Copyright (c) 2014 Bruno Jouhier <bjouhier@gmail.com>
+ * MIT License
+ */
+// Incremental JSON tokenizer, independent from V8.
+// The tokenizer is a table-driven state machine templated on a handler class.
+// Handler calls are resolved at compile time, so they can be inlined.
+//
+// A handler provides the following methods:
+//
+//   void objectOpen();
+//   void objectClose();
+//   void arrayOpen();
+//   void arrayClose();
+//   void key(char* p, size_t len, Encoding encoding);
+//   void string(char* p, size_t len, Encoding encoding);
+//   void number(char* p, size_t len, bool isInt); // p[len] is a non numeric char, so p can be passed to atof
+//   void boolean(bool val);
+//   void null();
+//   void discard(); // ndjson mode: a syntax error dropped the values being parsed, and those completed on its line
+//
+// len is in bytes, also for UTF16. Strings are unescaped; escaped and split strings are passed as UTF8.
+// The tokenizer checks the syntax: the handler only sees well-formed sequences of calls.
+// It may stop the parsing with fail(message), or pause it after the current value with pause().
+// update() then returns the number of chars consumed, and the rest of the chunk can be passed to the next update.
+//
+// In ndjson mode, top-level values are also separated by newlines and a syntax error does not stop the parsing:
+// it is added to errors, the values of its line are discarded, and the tokenizer skips to the next line.
+//
+// Usage:
+//
+//   MyHandler handler;
+//   ijson::core::Tokenizer<MyHandler> tokenizer(handler);
+//   tokenizer.update(chunk, chunkLen, ijson::core::UTF8); // as many times as needed
+//   if (!tokenizer.end()) fprintf(stderr, "%s\n", tokenizer.error->c_str());
+#ifndef IJSON_CORE_H
+#define IJSON_CORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "trace.h"
+#include "simd.h"
+
+namespace ijson {
+namespace core {
+  // Encoding of the data being parsed.
+  // Buffers are UTF-8; strings are scanned in place as Latin-1 or UTF-16.
+  // The keep buffer is always UTF-8.
+  enum Encoding { UTF8, LATIN1, UTF16 };
+
+  // character classes, OTHER is the class of all the characters which are not listed.
+  enum CharClass {
+    CURLY_OPEN, CURLY_CLOSE, SQUARE_OPEN, SQUARE_CLOSE, COMMA, COLON, DQUOTE, BSLASH, FSLASH, SPACE, NL,
+    t_, r_, u_, e_, f_, a_, l_, s_, n_, b_, PLUS, MINUS, DIGIT, DOT, E_, HEX_REMAIN, OTHER
+  };
+
+  class Classes {
+  public:
+    Classes() {
+      for (int i = 0; i < 256; i++) this->table[i] = OTHER;
+      this->make(CURLY_OPEN, "{");
+      this->make(CURLY_CLOSE, "}");
+      this->make(SQUARE_OPEN, "[");
+      this->make(SQUARE_CLOSE, "]");
+      this->make(COMMA, ",");
+      this->make(COLON, ":");
+      this->make(DQUOTE, "\"");
+      this->make(BSLASH, "\\");
+      this->make(FSLASH, "/");
+      this->make(SPACE, " \t\r");
+      this->make(NL, "\n");
+      this->make(t_, "t");
+      this->make(r_, "r");
+      this->make(u_, "u");
+      this->make(e_, "e");
+      this->make(f_, "f");
+      this->make(a_, "a");
+      this->make(l_, "l");
+      this->make(s_, "s");
+      this->make(n_, "n");
+      this->make(b_, "b");
+      this->make(PLUS, "+");
+      this->make(MINUS, "-");
+      this->make(DIGIT, "0123456789");
+      this->make(DOT, ".");
+      this->make(E_, "E");
+      this->make(HEX_REMAIN, "ABCDFcd");
+    }
+    int table[256];
+#ifdef IJSON_TRACE
+    const char* names[OTHER];
+#endif
+
+    void make(int cla, const char* str) {
+      for (int i = 0, len = strlen(str); i < len; i++) this->table[(int)str[i]] = cla;
+      TRACE_CLASS(this->names, cla, str);
+    }
+  };
+
+  // ndjson mode: a syntax error which was skipped. offset is in chars from the start of the document.
+  class SyntaxError {
+  public:
+    std::string message;
+    int line;
+    uint64_t offset;
+  };
+
+  inline int hex(int ch) {
+    if (ch <= '9') return ch - '0';
+    if (ch <= 'F') return 10 + ch - 'A';
+    return 10 + ch - 'a';
+  }
+
+  template <class Handler> class Tokenizer {
+  public:
+    typedef void (*Fn)(Tokenizer*, int, int);
+    typedef Fn* State;
+
+    // nesting stack entries. The root level is an array of top-level values.
+    enum { ARRAY = 1, NEEDS_VALUE = 2 };
+
+    Tokenizer(Handler& handler) : handler(handler) {
+      this->error = NULL;
+      this->pauseAfter = 0;
+      this->pauseDepth = 0;
+      this->bytes = 0;
+      this->reset();
+      this->encoding = UTF8;
+      this->data = NULL;
+      this->wdata = NULL;
+      this->len = 0;
+      this->tokenStart = 0;
+      this->tokenEnd = 0;
+      this->scan = simd::kernels().scanEscape;
+      this->splitTokens = 0;
+      this->bytesCopied = 0;
+      this->paused = false;
+      this->ndjson = false;
+      this->maxErrors = 1000;
+      this->syntaxErrors = 0;
+    }
+    ~Tokenizer() {
+      if (this->error) delete this->error;
+    }
+
+    Handler& handler;
+    int beg;
+    int line;
+    int lineStart; // ndjson mode: line where the current top-level line started, a value may span several lines
+    bool needsKey;
+    unsigned unicode;
+    std::string* error;
+    State state;
+    Encoding encoding;
+    char* data; // UTF8 and LATIN1
+    uint16_t* wdata; // UTF16
+    int len;
+    std::vector<char> keep; // split and escaped tokens, always UTF8
+    std::vector<char> stack;
+    simd::escapeFn scan;
+    // offsets in the current chunk of the first char of the value being parsed and after the last char of the value just parsed.
+    // Valid in the handler calls, except when a value spans several chunks.
+    int tokenStart;
+    int tokenEnd;
+    uint64_t bytes;
+    uint64_t docStart; // bytes at the start of the document
+    uint64_t splitTokens;
+    uint64_t bytesCopied;
+    bool paused; // until the next update
+    int pauseAfter; // pauses after every pauseAfter values completed at pauseDepth, 0 if disabled
+    int pauseDepth;
+    int pauseLeft;
+    bool ndjson;
+    std::vector<SyntaxError> errors; // ndjson mode, taken by the handler
+    size_t maxErrors; // further errors are only counted
+    uint64_t syntaxErrors;
+#ifdef IJSON_TRACE
+    trace::Trace trace;
+#endif
+
+    // gets ready for a new document. The counters are kept.
+    void reset() {
+      this->beg = -1;
+      this->line = 1;
+      this->lineStart = 1;
+      this->needsKey = false;
+      this->unicode = 0;
+      if (this->error) delete this->error;
+      this->error = NULL;
+      this->state = states.BEFORE_VALUE;
+      this->keep.clear();
+      this->stack.clear();
+      this->stack.push_back(ARRAY);
+      this->pauseLeft = this->pauseAfter;
+      this->errors.clear();
+      this->docStart = this->bytes;
+    }
+
+    // parses the next chunk. Returns the number of chars consumed: len, or less if there is an error.
+    int update(char* buf, int len, Encoding encoding) {
+      this->encoding = encoding;
+      return this->updateChunk(buf, len);
+    }
+
+    int update(uint16_t* buf, int len) {
+      this->encoding = UTF16;
+      return this->updateChunk(buf, len);
+    }
+
+    // to be called after the last chunk. Returns false if the input is incomplete.
+    bool end() {
+      if (this->error) return false;
+      // number values are only closed when we read past them. So we parse an extra space if still inside a number.
+      if (this->stack.size() == 1 && (this->state == states.INSIDE_NUMBER || this->state == states.AFTER_ZERO ||
+        this->state == states.INSIDE_DOUBLE || this->state == states.INSIDE_EXP)) {
+        this->paused = false;
+        this->encoding = UTF8;
+        this->parse((char*)" ", 1);
+      }
+      if (this->ndjson) {
+        // the last line may end without a newline, or be cut
+        bool complete = this->state == states.AFTER_VALUE || this->state == states.SKIP_LINE ||
+          (this->state == states.BEFORE_VALUE && this->stack.back() == ARRAY);
+        if (this->stack.size() > 1 || !complete) this->skipError("Unexpected end of input", 0);
+        return true;
+      }
+      if (this->stack.size() > 1 || this->state != states.AFTER_VALUE) return this->fail("Unexpected end of input");
+      return !this->error;
+    }
+
+    // stops the current update after the value being parsed
+    void pause() {
+      this->paused = true;
+    }
+
+    // pauses after every count values completed at depth (0 for the top-level values), never if count is 0
+    void pauseEvery(int count, int depth) {
+      this->pauseAfter = count;
+      this->pauseDepth = depth;
+      this->pauseLeft = count;
+    }
+
+    bool fail(const char* message) {
+      if (!this->error) this->error = new std::string(message);
+      return false;
+    }
+
+    int depth() {
+      return (int)this->stack.size() - 1;
+    }
+
+    // appends data[beg..end[ to out, converted to UTF-8
+    void appendUtf8(std::vector<char>& out, int beg, int end) {
+      if (this->encoding == UTF8) {
+        out.insert(out.end(), this->data + beg, this->data + end);
+      } else if (this->encoding == LATIN1) {
+        for (int i = beg; i < end; i++) {
+          unsigned u = this->data[i] & 0xff;
+          if (u < 0x80) out.push_back((char)u);
+          else {
+            out.push_back(0xc0 + (u >> 6));
+            out.push_back(0x80 + (u & 0x3f));
+          }
+        }
+      } else {
+        for (int i = beg; i < end; i++) {
+          unsigned u = this->wdata[i];
+          if (u >= 0xd800 && u < 0xdc00 && i + 1 < end && this->wdata[i + 1] >= 0xdc00 && this->wdata[i + 1] < 0xe000) {
+            u = 0x10000 + ((u - 0xd800) << 10) + (this->wdata[++i] - 0xdc00);
+          } else if (u >= 0xdc00 && u < 0xe000 && i == beg && out.size() >= 3 &&
+            (out.end()[-3] & 0xff) == 0xed && (out.end()[-2] & 0xf0) == 0xa0) {
+            // low surrogate of a pair split across chunks: the high one ends out, as a 3-byte sequence
+            unsigned high = 0xd000 + ((out.end()[-2] & 0x3f) << 6) + (out.end()[-1] & 0x3f);
+            out.resize(out.size() - 3);
+            u = 0x10000 + ((high - 0xd800) << 10) + (u - 0xdc00);
+          }
+          if (u < 0x80) out.push_back((char)u);
+          else if (u < 0x0800) {
+            out.push_back(0xc0 + (u >> 6));
+            out.push_back(0x80 + (u & 0x3f));
+          } else if (u < 0x10000) {
+            out.push_back(0xe0 + (u >> 12));
+            out.push_back(0x80 + ((u >> 6) & 0x3f));
+            out.push_back(0x80 + (u & 0x3f));
+          } else {
+            out.push_back(0xf0 + (u >> 18));
+            out.push_back(0x80 + ((u >> 12) & 0x3f));
+            out.push_back(0x80 + ((u >> 6) & 0x3f));
+            out.push_back(0x80 + (u & 0x3f));
+          }
+        }
+      }
+    }
+
+    void appendKeep(int beg, int end) {
+      size_t size = this->keep.size();
+      this->appendUtf8(this->keep, beg, end);
+      this->bytesCopied += this->keep.size() - size;
+    }
+
+    int charAt(int pos) {
+      return this->encoding == UTF16 ? this->wdata[pos] : this->data[pos] & 0xff;
+    }
+
+    void setError(int pos) {
+      char message[80];
+      int len = this->len - pos;
+      if (len > 20) len = 20;
+      std::vector<char> chars;
+      this->appendUtf8(chars, pos, pos + len);
+      std::string near(chars.begin(), chars.end());
+      std::replace(near.begin(), near.end(), '\n', '\0'); //
+      snprintf(message, sizeof message, "line %d: syntax error near %s", this->line, near.c_str());
+      IJSON_PROBE2(error, this->line, pos);
+      if (!this->ndjson) {
+        this->fail(message);
+      } else {
+        this->skipError(message, pos);
+        // the error may be the newline itself (inside a string)
+        if (pos < this->len && this->charAt(pos) == '\n') eatNL(this, pos, NL);
+        else this->state = states.SKIP_LINE;
+      }
+    }
+
+    // ndjson mode: records the error and drops the values being parsed
+    void skipError(const char* message, int pos) {
+      if (this->errors.size() < this->maxErrors) {
+        SyntaxError error;
+        error.message = message;
+        error.line = this->line;
+        error.offset = this->bytes - this->docStart + pos;
+        this->errors.push_back(error);
+      }
+      this->syntaxErrors++;
+      this->handler.discard();
+      this->stack.clear();
+      this->stack.push_back(ARRAY);
+      this->keep.clear();
+      this->beg = -1;
+      this->state = states.BEFORE_VALUE;
+    }
+
+  private:
+    template <class Char> int updateChunk(Char* buf, int len) {
+      this->paused = false;
+      int pos = this->parse(buf, len);
+      this->bytes += pos;
+      if (!this->error) {
+        if (this->beg != -1) {
+          this->appendKeep(this->beg, pos);
+          this->beg = 0;
+        }
+        if (this->keep.size() != 0) this->splitTokens++;
+      }
+      this->data = NULL;
+      this->wdata = NULL;
+      return pos;
+    }
+
+    void setData(char* buf) {
+      this->data = buf;
+    }
+
+    void setData(uint16_t* buf) {
+      this->wdata = buf;
+    }
+
+    int classOf(char ch) {
+      return classes.table[ch & 0xff];
+    }
+
+    int classOf(uint16_t ch) {
+      return ch < 256 ? classes.table[ch] : OTHER;
+    }
+
+    int scanString(const char* p, int len) {
+      return this->scan(p, len);
+    }
+
+    int scanString(const uint16_t* p, int len) {
+      int i = 0;
+      while (i < len) {
+        uint16_t ch = p[i];
+        if (ch == '"' || ch == '\\' || ch < 0x20) break;
+        i++;
+      }
+      return i;
+    }
+
+    int scanLine(const char* p, int len) {
+      const char* nl = (const char*)memchr(p, '\n', len);
+      return nl ? (int)(nl - p) : len;
+    }
+
+    int scanLine(const uint16_t* p, int len) {
+      int i = 0;
+      while (i < len && p[i] != '\n') i++;
+      return i;
+    }
+
+    // Char is char for UTF8 and LATIN1, uint16_t for UTF16
+    template <class Char> int parse(Char* buf, int len) {
+      this->setData(buf);
+      this->len = len;
+      int pos = 0;
+      TRACE_START(this, states.registry);
+      while (pos < len && !this->error && !this->paused) {
+        if (this->state == states.INSIDE_QUOTES) {
+          // skip to the next quote, backslash or control char
+          pos += this->scanString(buf + pos, len - pos);
+          if (pos == len) break;
+          // control chars must be escaped, the newline too: in ndjson mode, the error ends at the newline
+          if ((unsigned)buf[pos] < 0x20) {
+            this->setError(pos);
+            pos++;
+            continue;
+          }
+        } else if (this->state == states.SKIP_LINE) {
+          pos += this->scanLine(buf + pos, len - pos);
+          if (pos == len) break;
+        }
+        int cla = this->classOf(buf[pos]);
+        TRACE_ENTER(this, cla);
+        Fn fn = this->state[cla];
+        if (fn != NULL) fn(this, pos, cla);
+        pos++;
+      }
+      TRACE_STOP(this);
+      return pos;
+    }
+
+    // a value has been parsed in the current level
+    void value() {
+      this->stack.back() &= ~NEEDS_VALUE;
+    }
+
+    // a value has been completed in the current level
+    void completed() {
+      if (this->pauseAfter && this->depth() == this->pauseDepth && --this->pauseLeft == 0) {
+        this->pauseLeft = this->pauseAfter;
+        this->paused = true;
+      }
+    }
+
+    static void syntaxError(Tokenizer* t, int pos, int cla) {
+      t->setError(pos);
+    }
+
+    static void numberOpen(Tokenizer* t, int pos, int cla) {
+      t->tokenStart = pos;
+      t->beg = pos;
+      if (cla == MINUS) t->state = states.AFTER_MINUS;
+      else integerOpen(t, pos, cla);
+    }
+
+    // the integer part has no leading zero
+    static void integerOpen(Tokenizer* t, int pos, int cla) {
+      t->state = t->charAt(pos) == '0' ? states.AFTER_ZERO : states.INSIDE_NUMBER;
+    }
+
+    static void doubleOpen(Tokenizer* t, int pos, int cla) {
+      t->state = states.AFTER_DOT;
+    }
+
+    static void fractionOpen(Tokenizer* t, int pos, int cla) {
+      t->state = states.INSIDE_DOUBLE;
+    }
+
+    static void expOpen(Tokenizer* t, int pos, int cla) {
+      t->state = states.AFTER_E;
+    }
+
+    static void expSign(Tokenizer* t, int pos, int cla) {
+      t->state = states.AFTER_EXP_SIGN;
+    }
+
+    static void expDigits(Tokenizer* t, int pos, int cla) {
+      t->state = states.INSIDE_EXP;
+    }
+
+    static void numberClose(Tokenizer* t, int pos, int cla) {
+      int beg = t->beg;
+      t->beg = -1;
+      char* p;
+      size_t len;
+      if (t->keep.size() != 0 || t->encoding == UTF16) {
+        t->appendKeep(beg, pos + 1); // append stop char
+        p = &t->keep[0];
+        len = t->keep.size() - 1;
+      } else {
+        p = t->data + beg;
+        len = (size_t)(pos - beg);
+      }
+      t->value();
+      t->tokenEnd = pos;
+      t->handler.number(p, len, t->state == states.INSIDE_NUMBER || t->state == states.AFTER_ZERO);
+      t->completed();
+      t->keep.clear();
+      Fn fn = states.AFTER_VALUE[cla];
+      t->state = states.AFTER_VALUE;
+      if (fn) fn(t, pos, cla);
+    }
+
+    static void stringOpen(Tokenizer* t, int pos, int cla) {
+      t->needsKey = t->state == states.BEFORE_KEY;
+      t->tokenStart = pos;
+      t->beg = pos + 1;
+      t->state = states.INSIDE_QUOTES;
+    }
+
+    static void stringClose(Tokenizer* t, int pos, int cla) {
+      char* p;
+      size_t len;
+      Encoding encoding = t->encoding;
+      if (t->keep.size() != 0) {
+        t->appendKeep(t->beg, pos);
+        p = &t->keep[0];
+        len = t->keep.size();
+        encoding = UTF8;
+      } else if (encoding == UTF16) {
+        p = (char*)(t->wdata + t->beg);
+        len = (size_t)(pos - t->beg) * 2;
+      } else {
+        p = t->data + t->beg;
+        len = (size_t)(pos - t->beg);
+      }
+      t->beg = -1;
+      t->tokenEnd = pos + 1;
+      if (t->needsKey) {
+        t->handler.key(p, len, encoding);
+        t->state = states.AFTER_KEY;
+      } else {
+        t->value();
+        t->handler.string(p, len, encoding);
+        t->completed();
+        t->state = states.AFTER_VALUE;
+      }
+      t->keep.clear();
+    }
+
+    static void escapeOpen(Tokenizer* t, int pos, int cla) {
+      t->appendKeep(t->beg, pos);
+      t->beg = -1;
+      t->state = states.AFTER_ESCAPE;
+    }
+
+    static void escaped(Tokenizer* t, int pos, char ch) {
+      t->keep.push_back(ch);
+      t->beg = pos + 1;
+      t->state = states.INSIDE_QUOTES;
+    }
+
+    static void escapeB(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\b');
+    }
+
+    static void escapeF(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\f');
+    }
+
+    static void escapeR(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\r');
+    }
+
+    static void escapeN(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\n');
+    }
+
+    static void escapeT(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\t');
+    }
+
+    static void escapeDQUOTE(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '"');
+    }
+
+    static void escapeBSLASH(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '\\');
+    }
+
+    static void escapeFSLASH(Tokenizer* t, int pos, int cla) {
+      escaped(t, pos, '/');
+    }
+
+    static void u_xxxx(Tokenizer* t, int pos, int cla) {
+      t->state = states.U_XXXX;
+    }
+
+    static void ux_xxx(Tokenizer* t, int pos, int cla) {
+      t->unicode = hex(t->charAt(pos));
+      t->state = states.UX_XXX;
+    }
+
+    static void uxx_xx(Tokenizer* t, int pos, int cla) {
+      t->unicode = t->unicode * 16 + hex(t->charAt(pos));
+      t->state = states.UXX_XX;
+    }
+
+    static void uxxx_x(Tokenizer* t, int pos, int cla) {
+      t->unicode = t->unicode * 16 + hex(t->charAt(pos));
+      t->state = states.UXXX_X;
+    }
+
+    static void uxxxx_(Tokenizer* t, int pos, int cla) {
+      unsigned u = t->unicode * 16 + hex(t->charAt(pos));
+      // push UTF-8 representation of u
+      if (u < 0x80) t->keep.push_back((char)u);
+      else if (u < 0x0800) {
+        t->keep.push_back(0xc0 + (u >> 6));
+        t->keep.push_back(0x80 + (u & 0x3f));
+      } else {
+        t->keep.push_back(0xe0 + (u >> 12));
+        t->keep.push_back(0x80 + ((u >> 6) & 0x3f));
+        t->keep.push_back(0x80 + (u & 0x3f));
+      }
+      t->beg = pos + 1;
+      t->state = states.INSIDE_QUOTES;
+    }
+
+    static void t_rue(Tokenizer* t, int pos, int cla) {
+      t->tokenStart = pos;
+      t->state = states.T_RUE;
+    }
+
+    static void tr_ue(Tokenizer* t, int pos, int cla) {
+      t->state = states.TR_UE;
+    }
+
+    static void tru_e(Tokenizer* t, int pos, int cla) {
+      t->state = states.TRU_E;
+    }
+
+    static void true_(Tokenizer* t, int pos, int cla) {
+      t->value();
+      t->tokenEnd = pos + 1;
+      t->handler.boolean(true);
+      t->completed();
+      t->state = states.AFTER_VALUE;
+    }
+
+    static void f_alse(Tokenizer* t, int pos, int cla) {
+      t->tokenStart = pos;
+      t->state = states.F_ALSE;
+    }
+
+    static void fa_lse(Tokenizer* t, int pos, int cla) {
+      t->state = states.FA_LSE;
+    }
+
+    static void fal_se(Tokenizer* t, int pos, int cla) {
+      t->state = states.FAL_SE;
+    }
+
+    static void fals_e(Tokenizer* t, int pos, int cla) {
+      t->state = states.FALS_E;
+    }
+
+    static void false_(Tokenizer* t, int pos, int cla) {
+      t->value();
+      t->tokenEnd = pos + 1;
+      t->handler.boolean(false);
+      t->completed();
+      t->state = states.AFTER_VALUE;
+    }
+
+    static void n_ull(Tokenizer* t, int pos, int cla) {
+      t->tokenStart = pos;
+      t->state = states.N_ULL;
+    }
+
+    static void nu_ll(Tokenizer* t, int pos, int cla) {
+      t->state = states.NU_LL;
+    }
+
+    static void nul_l(Tokenizer* t, int pos, int cla) {
+      t->state = states.NUL_L;
+    }
+
+    static void null_(Tokenizer* t, int pos, int cla) {
+      t->value();
+      t->tokenEnd = pos + 1;
+      t->handler.null();
+      t->completed();
+      t->state = states.AFTER_VALUE;
+    }
+
+    static void arrayOpen(Tokenizer* t, int pos, int cla) {
+      t->value();
+      t->tokenStart = pos;
+      t->stack.push_back(ARRAY);
+      t->handler.arrayOpen();
+      t->state = states.BEFORE_VALUE;
+    }
+
+    static void arrayClose(Tokenizer* t, int pos, int cla) {
+      if (t->stack.size() == 1 || t->stack.back() != ARRAY) return t->setError(pos);
+      t->stack.pop_back();
+      t->tokenEnd = pos + 1;
+      t->handler.arrayClose();
+      t->completed();
+      t->state = states.AFTER_VALUE;
+    }
+
+    static void objectOpen(Tokenizer* t, int pos, int cla) {
+      t->value();
+      t->tokenStart = pos;
+      t->stack.push_back(0);
+      t->handler.objectOpen();
+      t->state = states.BEFORE_KEY;
+    }
+
+    static void objectClose(Tokenizer* t, int pos, int cla) {
+      if (t->stack.back() != 0) return t->setError(pos);
+      t->stack.pop_back();
+      t->tokenEnd = pos + 1;
+      t->handler.objectClose();
+      t->completed();
+      t->state = states.AFTER_VALUE;
+    }
+
+    static void eatColon(Tokenizer* t, int pos, int cla) {
+      t->state = states.BEFORE_VALUE;
+    }
+
+    static void eatComma(Tokenizer* t, int pos, int cla) {
+      t->stack.back() |= NEEDS_VALUE;
+      t->state = (t->stack.back() & ARRAY) ? states.BEFORE_VALUE : states.BEFORE_KEY;
+    }
+
+    static void eatNL(Tokenizer* t, int pos, int cla) {
+      t->line++;
+      // ndjson mode: a newline ends a top-level value, or the line being skipped
+      if (t->ndjson && t->stack.size() == 1) {
+        t->state = states.BEFORE_VALUE;
+        t->lineStart = t->line;
+      }
+    }
+
+    typedef struct Transition {
+      int cla;
+      Fn fn;
+    } Transition;
+
+    static State makeState(const Transition* transitions, Fn def) {
+      State state = new Fn[OTHER + 1];
+      for (int i = 0; i <= OTHER; i++) state[i] = def;
+      for (int i = 0; transitions[i].cla != -1; i++) state[transitions[i].cla] = transitions[i].fn;
+      return state;
+    }
+
+    static State makeHexState(Fn fn, Fn def) {
+      Transition transitions[] = {
+        { DIGIT, fn },
+        { a_, fn },
+        { b_, fn },
+        { e_, fn },
+        { f_, fn },
+        { E_, fn },
+        { HEX_REMAIN, fn },
+        { -1, NULL }
+      };
+      return makeState(transitions, def);
+    }
+
+    class States {
+    public:
+      State BEFORE_VALUE,
+        AFTER_VALUE,
+        BEFORE_KEY,
+        AFTER_KEY,
+        INSIDE_QUOTES,
+        AFTER_MINUS,
+        AFTER_ZERO,
+        INSIDE_NUMBER,
+        AFTER_DOT,
+        INSIDE_DOUBLE,
+        AFTER_E,
+        AFTER_EXP_SIGN,
+        INSIDE_EXP,
+        AFTER_ESCAPE,
+        U_XXXX,
+        UX_XXX,
+        UXX_XX,
+        UXXX_X,
+        T_RUE,
+        TR_UE,
+        TRU_E,
+        F_ALSE,
+        FA_LSE,
+        FAL_SE,
+        FALS_E,
+        N_ULL,
+        NU_LL,
+        NUL_L,
+        SKIP_LINE;
+#ifdef IJSON_TRACE
+      trace::Registry registry;
+#endif
+
+      States() {
+        Transition BEFORE_VALUE_TRANSITIONS[] = {
+          { CURLY_OPEN, objectOpen },
+          { SQUARE_OPEN, arrayOpen },
+          { DQUOTE, stringOpen },
+          { MINUS, numberOpen },
+          { DIGIT, numberOpen },
+          { t_, t_rue },
+          { f_, f_alse },
+          { n_, n_ull },
+          { SPACE, NULL },
+          { NL, eatNL },
+          { SQUARE_CLOSE, arrayClose },
+          { -1, NULL }
+        };
+        BEFORE_VALUE = makeState(BEFORE_VALUE_TRANSITIONS, syntaxError);
+
+        Transition AFTER_VALUE_TRANSITIONS[] = {
+          { COMMA, eatComma },
+          { CURLY_CLOSE, objectClose },
+          { SQUARE_CLOSE, arrayClose },
+          { SPACE, NULL },
+          { NL, eatNL },
+          { -1, NULL }
+        };
+        AFTER_VALUE = makeState(AFTER_VALUE_TRANSITIONS, syntaxError);
+
+        // object states
+        Transition BEFORE_KEY_TRANSITIONS[] = {
+          { DQUOTE, stringOpen },
+          { CURLY_CLOSE, objectClose },
+          { SPACE, NULL },
+          { NL, eatNL },
+          { -1, NULL }
+        };
+        BEFORE_KEY = makeState(BEFORE_KEY_TRANSITIONS, syntaxError);
+
+        Transition AFTER_KEY_TRANSITIONS[] = {
+          { COLON, eatColon },
+          { SPACE, NULL },
+          { NL, eatNL },
+          { -1, NULL }
+        };
+        AFTER_KEY = makeState(AFTER_KEY_TRANSITIONS, syntaxError);
+
+        // string states
+        Transition INSIDE_QUOTES_TRANSITIONS[] = {
+          { DQUOTE, stringClose },
+          { BSLASH, escapeOpen },
+          { NL, syntaxError },
+          { -1, NULL }
+        };
+        INSIDE_QUOTES = makeState(INSIDE_QUOTES_TRANSITIONS, NULL);
+
+        Transition AFTER_ESCAPE_TRANSITIONS[] = {
+          { b_, escapeB },
+          { f_, escapeF },
+          { n_, escapeN },
+          { r_, escapeR },
+          { t_, escapeT },
+          { DQUOTE, escapeDQUOTE },
+          { BSLASH, escapeBSLASH },
+          { FSLASH, escapeFSLASH },
+          { u_, u_xxxx },
+          { -1, NULL }
+        };
+        AFTER_ESCAPE = makeState(AFTER_ESCAPE_TRANSITIONS, syntaxError);
+
+        U_XXXX = makeHexState(ux_xxx, syntaxError);
+        UX_XXX = makeHexState(uxx_xx, syntaxError);
+        UXX_XX = makeHexState(uxxx_x, syntaxError);
+        UXXX_X = makeHexState(uxxxx_, syntaxError);
+
+        Transition T_RUE_TRANSITIONS[] = {
+          { r_, tr_ue },
+          { -1, NULL }
+        };
+        T_RUE = makeState(T_RUE_TRANSITIONS, syntaxError);
+
+        Transition TR_UE_TRANSITIONS[] = {
+          { u_, tru_e },
+          { -1, NULL }
+        };
+        TR_UE = makeState(TR_UE_TRANSITIONS, syntaxError);
+
+        Transition TRU_E_TRANSITIONS[] = {
+          { e_, true_ },
+          { -1, NULL }
+        };
+        TRU_E = makeState(TRU_E_TRANSITIONS, syntaxError);
+
+        Transition F_ALSE_TRANSITIONS[] = {
+          { a_, fa_lse },
+          { -1, NULL }
+        };
+        F_ALSE = makeState(F_ALSE_TRANSITIONS, syntaxError);
+
+        Transition FA_LSE_TRANSITIONS[] = {
+          { l_, fal_se },
+          { -1, NULL }
+        };
+        FA_LSE = makeState(FA_LSE_TRANSITIONS, syntaxError);
+
+        Transition FAL_SE_TRANSITIONS[] = {
+          { s_, fals_e },
+          { -1, NULL }
+        };
+        FAL_SE = makeState(FAL_SE_TRANSITIONS, syntaxError);
+
+        Transition FALS_E_TRANSITIONS[] = {
+          { e_, false_ },
+          { -1, NULL }
+        };
+        FALS_E = makeState(FALS_E_TRANSITIONS, syntaxError);
+
+        Transition N_ULL_TRANSITIONS[] = {
+          { u_, nu_ll },
+          { -1, NULL }
+        };
+        N_ULL = makeState(N_ULL_TRANSITIONS, syntaxError);
+
+        Transition NU_LL_TRANSITIONS[] = {
+          { l_, nul_l },
+          { -1, NULL }
+        };
+        NU_LL = makeState(NU_LL_TRANSITIONS, syntaxError);
+
+        Transition NUL_L_TRANSITIONS[] = {
+          { l_, null_ },
+          { -1, NULL }
+        };
+        NUL_L = makeState(NUL_L_TRANSITIONS, syntaxError);
+
+        // number states, following the JSON grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+        Transition AFTER_MINUS_TRANSITIONS[] = {
+          { DIGIT, integerOpen },
+          { -1, NULL }
+        };
+        AFTER_MINUS = makeState(AFTER_MINUS_TRANSITIONS, syntaxError);
+
+        Transition AFTER_ZERO_TRANSITIONS[] = {
+          { DIGIT, syntaxError },
+          { DOT, doubleOpen },
+          { e_, expOpen },
+          { E_, expOpen },
+          { -1, NULL }
+        };
+        AFTER_ZERO = makeState(AFTER_ZERO_TRANSITIONS, numberClose);
+
+        Transition INSIDE_NUMBER_TRANSITIONS[] = {
+          { DIGIT, NULL },
+          { DOT, doubleOpen },
+          { e_, expOpen },
+          { E_, expOpen },
+          { -1, NULL }
+        };
+        INSIDE_NUMBER = makeState(INSIDE_NUMBER_TRANSITIONS, numberClose);
+
+        Transition AFTER_DOT_TRANSITIONS[] = {
+          { DIGIT, fractionOpen },
+          { -1, NULL }
+        };
+        AFTER_DOT = makeState(AFTER_DOT_TRANSITIONS, syntaxError);
+
+        Transition INSIDE_DOUBLE_TRANSITIONS[] = {
+          { DIGIT, NULL },
+          { e_, expOpen },
+          { E_, expOpen },
+          { -1, NULL }
+        };
+        INSIDE_DOUBLE = makeState(INSIDE_DOUBLE_TRANSITIONS, numberClose);
+
+        Transition AFTER_E_TRANSITIONS[] = {
+          { PLUS, expSign },
+          { MINUS, expSign },
+          { DIGIT, expDigits },
+          { -1, NULL }
+        };
+        AFTER_E = makeState(AFTER_E_TRANSITIONS, syntaxError);
+
+        Transition AFTER_EXP_SIGN_TRANSITIONS[] = {
+          { DIGIT, expDigits },
+          { -1, NULL }
+        };
+        AFTER_EXP_SIGN = makeState(AFTER_EXP_SIGN_TRANSITIONS, syntaxError);
+
+        Transition INSIDE_EXP_TRANSITIONS[] = {
+          { DIGIT, NULL },
+          { -1, NULL }
+        };
+        INSIDE_EXP = makeState(INSIDE_EXP_TRANSITIONS, numberClose);
+
+        // ndjson mode: rest of a line with a syntax error
+        Transition SKIP_LINE_TRANSITIONS[] = {
+          { NL, eatNL },
+          { -1, NULL }
+        };
+        SKIP_LINE = makeState(SKIP_LINE_TRANSITIONS, NULL);
+
+        TRACE_STATE(this->registry, BEFORE_VALUE, STRUCTURAL);
+        TRACE_STATE(this->registry, AFTER_VALUE, STRUCTURAL);
+        TRACE_STATE(this->registry, BEFORE_KEY, STRUCTURAL);
+        TRACE_STATE(this->registry, AFTER_KEY, STRUCTURAL);
+        TRACE_STATE(this->registry, INSIDE_QUOTES, STRING);
+        TRACE_STATE(this->registry, AFTER_ESCAPE, STRING);
+        TRACE_STATE(this->registry, U_XXXX, STRING);
+        TRACE_STATE(this->registry, UX_XXX, STRING);
+        TRACE_STATE(this->registry, UXX_XX, STRING);
+        TRACE_STATE(this->registry, UXXX_X, STRING);
+        TRACE_STATE(this->registry, AFTER_MINUS, NUMBER);
+        TRACE_STATE(this->registry, AFTER_ZERO, NUMBER);
+        TRACE_STATE(this->registry, INSIDE_NUMBER, NUMBER);
+        TRACE_STATE(this->registry, AFTER_DOT, NUMBER);
+        TRACE_STATE(this->registry, INSIDE_DOUBLE, NUMBER);
+        TRACE_STATE(this->registry, AFTER_E, NUMBER);
+        TRACE_STATE(this->registry, AFTER_EXP_SIGN, NUMBER);
+        TRACE_STATE(this->registry, INSIDE_EXP, NUMBER);
+        TRACE_STATE(this->registry, T_RUE, STRUCTURAL);
+        TRACE_STATE(this->registry, TR_UE, STRUCTURAL);
+        TRACE_STATE(this->registry, TRU_E, STRUCTURAL);
+        TRACE_STATE(this->registry, F_ALSE, STRUCTURAL);
+        TRACE_STATE(this->registry, FA_LSE, STRUCTURAL);
+        TRACE_STATE(this->registry, FAL_SE, STRUCTURAL);
+        TRACE_STATE(this->registry, FALS_E, STRUCTURAL);
+        TRACE_STATE(this->registry, N_ULL, STRUCTURAL);
+        TRACE_STATE(this->registry, NU_LL, STRUCTURAL);
+        TRACE_STATE(this->registry, NUL_L, STRUCTURAL);
+        TRACE_STATE(this->registry, SKIP_LINE, STRUCTURAL);
+      }
+    };
+
+  public:
+    // tables are shared by all the tokenizers of a handler type
+    static States states;
+    static Classes classes;
+  };
+
+  template <class Handler> typename Tokenizer<Handler>::States Tokenizer<Handler>::states;
+  template <class Handler> Classes Tokenizer<Handler>::classes;
+}
+}
+#endif
@@ -6,6 +6,19 @@
 #include <node.h> 
 #include <node_buffer.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <zlib.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <stdio.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -14,46 +27,246 @@ using namespace node;
 using namespace v8;
 
 #include "uni.h"
+#include "core.h"
 
+// V8 binding: Parser is the handler of the core tokenizer and builds the JS values.
 namespace ijson {
   class Parser;
   class Frame;
-  typedef void (*parseFn)(Parser*, int, int);
-  typedef parseFn* State;
 
 #include "fasthash.c"
 
+  using core::Encoding;
+  using core::UTF8;
+  using core::LATIN1;
+  using core::UTF16;
+
 #define CacheEntryMaxSize 16
+#define InflateWindowSize 65536
+#define FileWindowSize (4 << 20)
+#define MaxPredictedKeys 64
+#define PredictedKeyMaxSize 64
+#define MaxTransforms 32
+#define TransformMaxSize 64
 
   class CacheEntry {
   public:
     CacheEntry() {
       this->len = -1;
+      this->encoding = UTF8;
+      this->gen = 0;
     }
 
     char bytes[CacheEntryMaxSize];
     char len;
+    char encoding;
+    uint32_t gen; // entry is valid if it has the generation of the cache
     Local<Value> value;
+    Persistent<Value> pvalue; // persistent caches only
   };
 
+  // Caches hold local handles, so they are cleared at every update (by bumping the generation).
+  // A persistent cache survives across updates and documents. It backs the keys cache, so that keys stay warm.
   class Cache {
   public:
-    Cache(int size) {
-      this->entries = new CacheEntry[size]();
-      this->size = size;
+    Cache(int capacity, bool persistent) {
+      this->entries = new CacheEntry[capacity]();
+      this->capacity = capacity;
+      this->size = capacity;
+      this->gen = 1;
+      this->persistent = persistent;
+      this->next = NULL;
       this->hits = 0;
       this->misses = 0;
     }
     ~Cache() {
-      //printf("hits=%d, misses=%d\n", this->hits, this->misses);
+      if (this->persistent) {
+        for (int i = 0; i < this->capacity; i++) uni::Dispose(Isolate::GetCurrent(), this->entries[i].pvalue);
+      }
       delete[] this->entries;
     }
     CacheEntry *entries;
+    int capacity;
     int size;
+    uint32_t gen;
+    bool persistent;
+    Cache* next; // looked up on misses
     int hits;
     int misses;
 
-    void intern(Parser* parser, char* p, size_t len, Local<Value>* val, Cache* next, uint64_t hash);
+    // invalidates all the entries and uses the first size entries
+    void clear(int size) {
+      this->size = size < this->capacity ? size : this->capacity;
+      this->gen++;
+      this->hits = 0;
+      this->misses = 0;
+    }
+
+    void intern(Parser* parser, char* p, size_t len, Encoding encoding, Local<Value>* val, bool symbol, uint64_t hash);
+  };
+
+  // Counters are cumulative over the life of the parser.
+  // They are plain increments so that they can stay enabled in production.
+  class Stats {
+  public:
+    Stats() {
+      memset(this, 0, sizeof(*this));
+    }
+    uint64_t bytes;
+    uint64_t objects;
+    uint64_t arrays;
+    uint64_t strings;
+    uint64_t numbers;
+    uint64_t booleans;
+    uint64_t nulls;
+    uint64_t keyHits;
+    uint64_t keyMisses;
+    uint64_t valueHits;
+    uint64_t valueMisses;
+    uint64_t splitTokens;
+    uint64_t bytesCopied;
+    int maxDepth;
+    uint64_t callbacks;
+    uint64_t callbackTime; // nanoseconds
+    uint64_t externalStrings;
+    uint64_t coalesced;
+    uint64_t compressedBytes;
+    uint64_t keyPredictions;
+    uint64_t transformed;
+    uint64_t syntaxErrors;
+
+    Local<Object> toObject(Isolate* isolate);
+  };
+
+  // columnar option: a column of a top-level array of records.
+  // Numbers stay in a native buffer until the column gets a non-number value.
+  class Column {
+  public:
+    std::string name; // key bytes of the first record, as found in the input
+    Encoding encoding;
+    bool numeric;
+    bool ints;
+    std::vector<double> numbers;
+  };
+
+  // key prediction: a key of the last object parsed at a depth.
+  // Records usually have the same keys in the same order, so a key is first compared with the key at the same
+  // position in the previous object, which skips the hashing and the probe of the keys cache.
+  class PredictedKey {
+  public:
+    PredictedKey() {
+      this->len = -1;
+      this->encoding = UTF8;
+    }
+    char bytes[PredictedKeyMaxSize];
+    int len;
+    Encoding encoding;
+    Persistent<Value> pvalue;
+  };
+
+  // transforms option: a token of the path of a rule, kept in every input encoding so that keys are compared in place
+  class TransformToken {
+  public:
+    bool any; // * matches any key or index
+    int index; // array index, -1 if the token is not one
+    std::string utf8;
+    std::string latin1;
+    bool oneByte; // latin1 is set
+    std::vector<uint16_t> utf16;
+
+    bool matches(char* p, size_t len, Encoding encoding) {
+      if (this->any) return true;
+      switch (encoding) {
+      case LATIN1: return this->oneByte && len == this->latin1.size() && !memcmp(p, this->latin1.data(), len);
+      case UTF16: return len == this->utf16.size() * 2 && (len == 0 || !memcmp(p, &this->utf16[0], len));
+      default: return len == this->utf8.size() && !memcmp(p, this->utf8.data(), len);
+      }
+    }
+  };
+
+  // Rules are numbered by their bit in the masks. A rule without a path applies to all the values.
+  class TransformRule {
+  public:
+    bool global;
+    std::vector<TransformToken> tokens;
+  };
+
+  class Transforms {
+  public:
+    Transforms() {
+      this->dates = 0;
+      this->numbers = 0;
+      this->dropNulls = 0;
+      this->renames = 0;
+      this->global = 0;
+    }
+    std::vector<TransformRule> rules;
+    uint32_t dates; // ISO-8601 strings to Date
+    uint32_t numbers; // numeric strings to numbers
+    uint32_t dropNulls; // null members are not set
+    uint32_t renames; // members are set with another key
+    uint32_t global;
+    std::vector<uint32_t> exact; // rules with a path of n tokens
+    std::vector<uint32_t> deeper; // rules with a path of more than n tokens
+    Persistent<Value> renamed[MaxTransforms];
+
+    uint32_t exactAt(int depth) { return depth < (int)this->exact.size() ? this->exact[depth] : 0; }
+    uint32_t deeperAt(int depth) { return depth < (int)this->deeper.size() ? this->deeper[depth] : 0; }
+  };
+
+  // externalStrings option: large string values are copied once into slabs allocated outside of the V8 heap
+  // and exposed as external strings, so the GC never copies them. The input is not referenced after update() returns.
+  // A slab is filled by the strings of successive updates; it is freed when the parser and all its strings have released it.
+#define SlabSize (64 * 1024)
+  class Slab {
+  public:
+    Slab(size_t size) {
+      this->data = (char*)malloc(size);
+      this->size = size;
+      this->used = 0;
+      this->refs = 1; // the parser's reference, released when the slab is full
+    }
+    ~Slab() {
+      free(this->data);
+    }
+    char* data;
+    size_t size;
+    size_t used;
+    int refs;
+
+    void release() {
+      if (--this->refs == 0) delete this;
+    }
+  };
+
+  class ExternalString: public uni::ExternalOneByteResource {
+  public:
+    ExternalString(Slab* slab, const char* p, size_t len) {
+      this->slab = slab;
+      this->p = p;
+      this->len = len;
+      slab->refs++;
+    }
+    ~ExternalString() {
+      this->slab->release();
+    }
+    const char* data() const { return this->p; }
+    size_t length() const { return this->len; }
+
+  private:
+    Slab* slab;
+    const char* p;
+    size_t len;
+  };
+
+  // argument of update: a buffer, or a string scanned in place
+  class Input {
+  public:
+    char* data; // UTF8 and LATIN1
+    uint16_t* wdata; // UTF16
+    Encoding encoding;
+    int len;
+    Local<Object> buf; // UTF8 only
   };
 
   class Parser: public ObjectWrap {
@@ -65,46 +278,316 @@ namespace ijson {
     Parser();
     ~Parser();
 
-    int beg;
-    int line;
-    bool needsKey;
-    uint unicode;
-    std::string* error;
-    State state;
+    core::Tokenizer<Parser> tokenizer;
     Frame* frame;
-    char* data;
-    int len;
     Isolate* isolate;
-    std::vector<char> keep;
+    std::vector<char> scratch; // flattened string input
+    std::vector<uint16_t> wscratch;
+    Persistent<String> flattened; // string in scratch or wscratch, kept while update() is paused in it
     Cache* keysCache;
     Cache* valuesCache;
+    Cache* warmKeys; // behind keysCache
     int callbackDepth;
     Persistent<Function> callback;
+    bool validateOnly; // check syntax and UTF-8 without creating values
+    bool typedArrays; // return arrays of numbers as Float64Array or Int32Array
+    bool columnar; // return a top-level array of uniform records as an object of columns
+    std::vector<Column> columns;
+    int records; // number of records stored in columns
+    int column; // current column in the record being parsed
+    int markLine; // ndjson mode: lineStart of the last top-level value, and the root array before it
+    uint32_t markLength;
+    int markPos;
+    int externalMin; // externalStrings option: minimum length, 0 if disabled
+    bool predictKeys; // disabled with keyOrder: false
+    std::vector<std::string> keyOrder; // keyOrder option: initial predictions of every depth
+    Slab* slab; // slab being filled by external strings, NULL until the first one
+    int coalesce; // coalesce option: buffers smaller than this are accumulated, 0 if disabled
+    uint64_t coalesceDelay; // nanoseconds, 0 if none
+    uint64_t pendingSince;
+    std::vector<char> pending; // coalesced buffers
+    bool pendingPaused; // the parser paused in the pending bytes, so new input waits behind them
+    z_stream* zstream; // inflate option: compressed input, NULL if disabled
+    bool inflated; // end of the compressed stream
+    std::vector<char> window; // inflated bytes, parsed each time the window is full
+    int windowPos; // window[windowPos..windowLen[ is left to parse after a pause
+    int windowLen;
+    Transforms transforms;
+    simd::Utf8Validator utf8;
+    Stats stats;
+
+    // core::Tokenizer handler
+    void objectOpen();
+    void objectClose();
+    void arrayOpen();
+    void arrayClose();
+    void key(char* p, size_t len, Encoding encoding);
+    void string(char* p, size_t len, Encoding encoding);
+    void number(char* p, size_t len, bool isInt);
+    void boolean(bool val);
+    void null();
+    void discard();
+    void markValue(Frame* root);
+
+    void setOptions(Isolate* isolate, Local<Object> options);
+    void setTransforms(Isolate* isolate, Local<Array> rules);
+    void reset();
+    void setNumber(double val, bool isInt);
+    uint32_t selected(Frame* frame);
+    bool transformString(char* p, size_t len, Encoding encoding);
+    Local<Value> memberKey(Frame* frame);
+    bool decode(Local<Value> arg, Input& in);
+    int parse(Input& in);
+    int run(Input& in);
+    void flush();
+    int inflate(Input& in, int (Parser::*parse)(Input&));
+    bool parseWindow(int (Parser::*parse)(Input&));
+    int feed(Input& in);
+    void feedAll(Input& in);
+    bool parseFile(const char* path);
 
     static uni::CallbackType Update(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType UpdateFile(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType Pause(const uni::FunctionCallbackInfo& args);
     static uni::CallbackType Result(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType GetStats(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType GetErrors(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType Flush(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType Reset(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType ParseMany(const uni::FunctionCallbackInfo& args);
+#ifdef IJSON_TRACE
+    static uni::CallbackType GetTrace(const uni::FunctionCallbackInfo& args);
+#endif
+  };
+
+  // Structural index of a document, for JSON pointer lookups.
+  // Values are stored in document order: the children of a container follow it, and next skips over its subtree.
+  class IndexEntry {
+  public:
+    uint32_t begin; // offsets of the value in the buffer
+    uint32_t end;
+    uint32_t next; // entry after the subtree
+    uint32_t key; // key in the keys pool, if the value is an object member
+    uint32_t keyLen;
+    bool object;
+  };
+
+  class Index: public ObjectWrap {
+  public:
+    static uni::CallbackType New(const uni::FunctionCallbackInfo& args);
+    static Persistent<FunctionTemplate> constructorTemplate;
+
+    std::vector<IndexEntry> entries;
+    std::string keys; // unescaped UTF8
+
+    int find(Local<Array> tokens);
+
+    static uni::CallbackType Range(const uni::FunctionCallbackInfo& args);
+  };
+
+  // key of an object being serialized, with its quotes and colon.
+  // Objects of the same shape share their key strings, so keys are compared by handle, at the same position.
+  class SerializedKey {
+  public:
+    Persistent<Value> pkey;
+    std::string bytes;
+  };
+
+  // an array or object being serialized
+  class SerializerFrame {
+  public:
+    SerializerFrame() {
+      this->keys = NULL;
+    }
+    ~SerializerFrame() {
+      Isolate* isolate = Isolate::GetCurrent();
+      uni::Dispose(isolate, this->pvalue);
+      uni::Dispose(isolate, this->pnames);
+      if (this->keys) {
+        for (int i = 0; i < MaxPredictedKeys; i++) uni::Dispose(isolate, this->keys[i].pkey);
+        delete[] this->keys;
+      }
+    }
+    // Local handles are only valid during a next() call, they are restored from the persistent ones
+    Persistent<Object> pvalue;
+    Persistent<Array> pnames;
+    Local<Object> value;
+    Local<Array> names; // objects: own enumerable property names
+    uint32_t index; // next element or property
+    uint32_t length;
+    bool array;
+    bool empty; // no property written yet
+    SerializedKey* keys; // keys cache of this depth, allocated by the first object
   };
 
-  void Cache::intern(Parser* parser, char* p, size_t len, Local<Value>* val, Cache* next, uint64_t hash) {
+  // incremental JSON serializer: the output is pulled in chunks with next(maxBytes), so that a large value
+  // does not block the event loop, and is not held in memory as a whole.
+  // Arrays and objects are walked with an explicit stack, which is kept between next() calls.
+  class Serializer: public ObjectWrap {
+  public:
+    static uni::CallbackType New(const uni::FunctionCallbackInfo& args);
+    static uni::CallbackType Next(const uni::FunctionCallbackInfo& args);
+    static Persistent<FunctionTemplate> constructorTemplate;
+
+    Serializer();
+    ~Serializer();
+
+    Isolate* isolate;
+    Persistent<Value> root; // until the first step
+    std::vector<SerializerFrame*> frames; // allocated once per depth
+    int depth; // number of open frames
+    bool started;
+    bool done;
+    bool aborted; // toJSON threw
+    std::string error;
+    std::vector<char> out; // serialized bytes, returned from outPos
+    size_t outPos;
+    std::vector<char> scratch;
+    std::vector<uint16_t> wscratch;
+    Local<Value> toJSON; // during next()
+
+    void step();
+    void value(Local<Value> val, SerializerFrame* parent, Local<Value> name);
+    void key(SerializerFrame* frame, Local<Value> name);
+    void push(Local<Object> obj, bool array, uint32_t length);
+    void string(Local<String> str);
+    void escape(const char* p, size_t len);
+    void utf16(const uint16_t* p, size_t len);
+    void number(double val);
+
+    void write(const char* p, size_t len) {
+      this->out.insert(this->out.end(), p, p + len);
+    }
+  };
+
+  // core::Tokenizer handler which builds the index
+  class IndexBuilder {
+  public:
+    IndexBuilder(Index* index) : tokenizer(*this) {
+      this->index = index;
+      this->keyPos = 0;
+      this->keyLen = 0;
+    }
+
+    core::Tokenizer<IndexBuilder> tokenizer;
+    Index* index;
+    std::vector<uint32_t> open; // entries of the containers being parsed
+    uint32_t keyPos; // last key in the keys pool
+    uint32_t keyLen;
+
+    void add(bool object) {
+      IndexEntry entry;
+      entry.begin = this->tokenizer.tokenStart;
+      entry.end = this->tokenizer.tokenEnd;
+      entry.next = this->index->entries.size() + 1;
+      entry.object = object;
+      bool member = !this->open.empty() && this->index->entries[this->open.back()].object;
+      entry.key = member ? this->keyPos : 0;
+      entry.keyLen = member ? this->keyLen : 0;
+      this->index->entries.push_back(entry);
+    }
+
+    void close() {
+      IndexEntry& entry = this->index->entries[this->open.back()];
+      entry.end = this->tokenizer.tokenEnd;
+      entry.next = this->index->entries.size();
+      this->open.pop_back();
+    }
+
+    void objectOpen() {
+      this->add(true);
+      this->open.push_back(this->index->entries.size() - 1);
+    }
+    void objectClose() { this->close(); }
+    void arrayOpen() {
+      this->add(false);
+      this->open.push_back(this->index->entries.size() - 1);
+    }
+    void arrayClose() { this->close(); }
+    void key(char* p, size_t len, Encoding encoding) {
+      this->keyPos = this->index->keys.size();
+      this->keyLen = len;
+      this->index->keys.append(p, len);
+    }
+    void string(char* p, size_t len, Encoding encoding) { this->add(false); }
+    void number(char* p, size_t len, bool isInt) { this->add(false); }
+    void boolean(bool val) { this->add(false); }
+    void null() { this->add(false); }
+    void discard() {} // the index is never built in ndjson mode
+  };
+
+  inline void setStat(Isolate* isolate, Local<Object> obj, const char* name, double val) {
+    obj->Set(uni::NewSymbol(isolate, name), uni::NewNumber(isolate, val));
+  }
+
+  Local<Object> Stats::toObject(Isolate* isolate) {
+    Local<Object> obj = uni::NewObject(isolate);
+    setStat(isolate, obj, "bytes", (double)this->bytes);
+    setStat(isolate, obj, "objects", (double)this->objects);
+    setStat(isolate, obj, "arrays", (double)this->arrays);
+    setStat(isolate, obj, "strings", (double)this->strings);
+    setStat(isolate, obj, "numbers", (double)this->numbers);
+    setStat(isolate, obj, "booleans", (double)this->booleans);
+    setStat(isolate, obj, "nulls", (double)this->nulls);
+    setStat(isolate, obj, "keyHits", (double)this->keyHits);
+    setStat(isolate, obj, "keyMisses", (double)this->keyMisses);
+    setStat(isolate, obj, "valueHits", (double)this->valueHits);
+    setStat(isolate, obj, "valueMisses", (double)this->valueMisses);
+    setStat(isolate, obj, "splitTokens", (double)this->splitTokens);
+    setStat(isolate, obj, "bytesCopied", (double)this->bytesCopied);
+    setStat(isolate, obj, "maxDepth", this->maxDepth);
+    setStat(isolate, obj, "callbacks", (double)this->callbacks);
+    setStat(isolate, obj, "callbackTime", this->callbackTime / 1e6); // milliseconds
+    setStat(isolate, obj, "externalStrings", (double)this->externalStrings);
+    setStat(isolate, obj, "coalesced", (double)this->coalesced);
+    setStat(isolate, obj, "compressedBytes", (double)this->compressedBytes);
+    setStat(isolate, obj, "keyPredictions", (double)this->keyPredictions);
+    setStat(isolate, obj, "transformed", (double)this->transformed);
+    setStat(isolate, obj, "syntaxErrors", (double)this->syntaxErrors);
+    return obj;
+  }
+
+  // len is in bytes, also for UTF16
+  inline Local<Value> newString(Isolate* isolate, char* p, size_t len, Encoding encoding, bool symbol) {
+    switch (encoding) {
+    case LATIN1: return uni::NewOneByteString(isolate, (uint8_t*)p, len);
+    case UTF16: return uni::NewTwoByteString(isolate, (uint16_t*)p, len / 2);
+    default: return symbol ? uni::NewSymbol(isolate, p, len) : uni::NewString(isolate, p, len);
+    }
+  }
+
+  void Cache::intern(Parser* parser, char* p, size_t len, Encoding encoding, Local<Value>* val, bool symbol, uint64_t hash) {
     if (len > CacheEntryMaxSize) {
-      *val = next ? uni::NewSymbol(parser->isolate, p, len) : uni::NewString(parser->isolate, p, len);
+      *val = newString(parser->isolate, p, len, encoding, symbol);
       return;
     }
     if (hash == 0) hash = fasthash64(p, len, 0);
 
     CacheEntry* entry = this->entries + (hash % this->size);
-    if ((size_t)entry->len == len && !memcmp(p, entry->bytes, len)) {
-      *val = entry->value;
+    if (entry->gen == this->gen && (size_t)entry->len == len && entry->encoding == encoding && !memcmp(p, entry->bytes, len)) {
+      if (this->persistent) *val = uni::HandleToLocal(uni::Deref(parser->isolate, entry->pvalue));
+      else *val = entry->value;
       this->hits++;
       return;
     }
-    *val = next ? uni::NewSymbol(parser->isolate, p, len) : uni::NewString(parser->isolate, p, len);
-    entry->value = *val;
+    if (this->next) this->next->intern(parser, p, len, encoding, val, symbol, hash);
+    else *val = newString(parser->isolate, p, len, encoding, symbol);
+    if (this->persistent) uni::Reset(parser->isolate, entry->pvalue, *val);
+    else entry->value = *val;
     memcpy(entry->bytes, p, len);
     entry->len = len;
+    entry->encoding = encoding;
+    entry->gen = this->gen;
     this->misses++;
   }
 
+  inline bool isInt32(double val, bool isInt) {
+    return isInt && val >= INT32_MIN && val <= INT32_MAX && !(val == 0 && signbit(val));
+  }
+
+  void columnValue(Parser* parser, Frame* top, Local<Value> val);
+  void uncolumnize(Parser* parser, Frame* top);
+
   class Frame {
   public:
     Frame(Parser* parser, Frame* prev, bool alloc) {
@@ -115,11 +598,23 @@ namespace ijson {
       this->value = alloc ? new Local<Value>() : NULL;
       this->key = alloc ? new Local<Value>() : NULL;
       this->depth = prev ? prev->depth + 1 : 0;
+      this->numeric = false;
+      this->ints = false;
+      this->columnar = false;
+      this->record = false;
+      this->predicted = NULL;
+      this->keyPos = 0;
+      this->rules = 0;
+      this->keyRules = 0;
     }
     ~Frame() {
       if (this->next) delete this->next;
       if (this->value) delete this->value;
       if (this->key) delete this->key;
+      if (this->predicted) {
+        for (int i = 0; i < MaxPredictedKeys; i++) uni::Dispose(this->parser->isolate, this->predicted[i].pvalue);
+        delete[] this->predicted;
+      }
     }
     // Local values are faster but we cannot keep them across calls.
     // So we back them with persistent slots.
@@ -132,11 +627,28 @@ namespace ijson {
     Frame* prev;
     Frame* next;
     int arrayPos;
-    bool needsValue;
     int depth;
+    // typedArrays option: the elements of an array are collected in numbers until the array closes.
+    // numeric is cleared (and the numbers moved to a JS array) as soon as a non-number shows up.
+    bool numeric;
+    bool ints; // all elements are integer literals that fit in an int32
+    std::vector<double> numbers;
+    // columnar option: value holds the column arrays and key the column keys while the array is columnar.
+    // The records themselves are never created, their values go straight to the columns.
+    bool columnar;
+    bool record;
+    // key prediction: keys of the last object of this depth, allocated by the first key
+    PredictedKey* predicted;
+    int keyPos; // position of the next key in the object
+    // transforms option: rules whose path may select the values of this frame, and those matching the current key
+    uint32_t rules;
+    uint32_t keyRules;
 
     void setValue(Local<Value> val) {
-      this->needsValue = false;
+      if (this->depth == 0 && this->parser->tokenizer.ndjson) this->parser->markValue(this);
+      if (this->record) return columnValue(this->parser, this->prev, val);
+      if (this->columnar) uncolumnize(this->parser, this); // element is not a record
+      if (this->numeric) this->flushNumbers();
       if (this->depth <= this->parser->callbackDepth) {
         val = this->callback(val);
         if (val->IsUndefined()) {
@@ -151,10 +663,39 @@ namespace ijson {
         this->arrayPos++;
       } else {
         Local<Object> obj = Local<Object>::Cast(*this->value);
-        obj->Set(*this->key, val);
+        obj->Set(this->parser->transforms.renames ? this->parser->memberKey(this) : *this->key, val);
       }
     }
 
+    void pushNumber(double val, bool isInt) {
+      if (this->ints && !isInt32(val, isInt)) this->ints = false;
+      this->numbers.push_back(val);
+      this->arrayPos++;
+    }
+
+    void flushNumbers() {
+      Isolate* isolate = this->parser->isolate;
+      Local<Array> arr = uni::NewArray(isolate, 0);
+      for (size_t i = 0; i < this->numbers.size(); i++) arr->Set(i, uni::NewNumber(isolate, this->numbers[i]));
+      *this->value = arr;
+      this->numbers.clear();
+      this->numeric = false;
+    }
+
+    // called when the array closes while still numeric. Empty arrays stay plain arrays.
+    void typedArray() {
+      if (this->numbers.empty()) *this->value = uni::NewArray(this->parser->isolate, 0);
+      else *this->value = uni::NewTypedArray(this->parser->isolate, &this->numbers[0], this->numbers.size(), this->ints);
+      this->numbers.clear();
+      this->numeric = false;
+    }
+
+    // validateOnly mode: a value was parsed but not created
+    void skipValue() {
+      if (this->depth == 0 && this->parser->tokenizer.ndjson) this->parser->markValue(this);
+      if (this->arrayPos >= 0) this->arrayPos++;
+    }
+
     Local<Value> callback(Local<Value> val) {
       Isolate* isolate = this->parser->isolate;
       Local<Array> path = uni::NewArray(isolate, this->depth);
@@ -165,9 +706,14 @@ namespace ijson {
       Handle<Value> argv[2];
       argv[0] = val;
       argv[1] = path;
+      uint64_t t0 = uv_hrtime();
+      IJSON_PROBE1(callback__start, this->depth);
       Handle<Value> res = uni::MakeCallback(isolate, 
         uni::GetCurrentContext(isolate)->Global(), 
         uni::Deref(isolate, this->parser->callback), 2, argv);
+      IJSON_PROBE1(callback__done, this->depth);
+      this->parser->stats.callbacks++;
+      this->parser->stats.callbackTime += uv_hrtime() - t0;
       return uni::HandleToLocal(res);
     }
 
@@ -180,6 +726,13 @@ namespace ijson {
       uni::Dispose(isolate, this->pkey);
     }
 
+    // frames above the current one are not saved: when one is reused, the handles left by a previous update
+    // belong to a closed HandleScope. They are cleared so that only the values set since are saved.
+    void clear() {
+      *this->value = Local<Value>();
+      *this->key = Local<Value>();
+    }
+
     void save(Isolate* isolate) {
       uni::Reset(isolate, this->pvalue, *this->value);
       delete this->value;
@@ -190,627 +743,757 @@ namespace ijson {
     }
   };
 
-  int lastClass = 0;
-
-  int classes[256];
-
-  int init1() {
-    for (int i = 0; i < 256; i++) classes[i] = -1;
-    return 0;
-  }
-
-  int dummy1 = init1();
-
-  int makeClass(const char* str) {
-    for (int i = 0, len = strlen(str); i < len; i++) {
-      char ch = str[i];
-      if (classes[(int)ch] != -1) { printf("duplicate class: %d\n", str[i]); exit(1); }
-      classes[(int)ch] = lastClass;
-    }
-    return lastClass++;
-  }
-
-  // basic classes
-  int CURLY_OPEN = makeClass("{"), 
-    CURLY_CLOSE = makeClass("}"),
-    SQUARE_OPEN = makeClass("["), 
-    SQUARE_CLOSE = makeClass("]"),
-    COMMA = makeClass(","),
-    COLON = makeClass(":"),
-    DQUOTE = makeClass("\""),
-    BSLASH = makeClass("\\"),
-    FSLASH = makeClass("/"),
-    SPACE = makeClass(" \t\r"),
-    NL = makeClass("\n"),
-    t_ = makeClass("t"),
-    r_ = makeClass("r"),
-    u_ = makeClass("u"),
-    e_ = makeClass("e"),
-    f_ = makeClass("f"),
-    a_ = makeClass("a"),
-    l_ = makeClass("l"),
-    s_ = makeClass("s"),
-    n_ = makeClass("n"),
-    b_ = makeClass("b"),
-    PLUS = makeClass("+"),
-    MINUS = makeClass("-"),
-    DIGIT = makeClass("0123456789"),
-    DOT = makeClass("."),
-    E_ = makeClass("E"),
-    HEX_REMAIN = makeClass("ABCDFcd");
-
-
-  int init2() {
-    for (int i = 0; i < 256; i++) {
-      if (classes[i] == -1) classes[i] = lastClass;
-    }
-    return 0;
-  }
-  int dummy2 = init2();
-
-  typedef struct Transition {
-    int cla;
-    parseFn fn;
-  } Transition;
-
-  State makeState(Transition* transitions, parseFn def) {
-    State state = new parseFn[lastClass + 1];
-    for (int i = 0; i <= lastClass; i++) state[i] = def;
-    for (int i = 0; transitions[i].cla != -1; i++) {
-      Transition transition = transitions[i];
-      state[transition.cla] = transition.fn;
-    }
-    return state;
-  }
-
-  void fillTransition(Transition* t, int cla, parseFn fn) {
-    t->cla = cla;
-    t->fn = fn;
-  }
-
-  inline int hex(char ch) {
-    if (ch <= '9') return ch - '0';
-    if (ch <= 'F') return 10 + ch - 'A';
-    return 10 + ch - 'a';
-  }
-
-  State makeHexState(parseFn fn, parseFn def) {
-    Transition* transitions = new Transition[8];
-    fillTransition(transitions + 0, DIGIT, fn);
-    fillTransition(transitions + 1, a_, fn);
-    fillTransition(transitions + 2, b_, fn);
-    fillTransition(transitions + 3, e_, fn);
-    fillTransition(transitions + 4, f_, fn);
-    fillTransition(transitions + 5, E_, fn);
-    fillTransition(transitions + 6, HEX_REMAIN, fn);
-    fillTransition(transitions + 7, -1, NULL);
-    return makeState(transitions, def);
-  }
-
-  State BEFORE_VALUE,
-    AFTER_VALUE,
-    BEFORE_KEY,
-    AFTER_KEY,
-    INSIDE_QUOTES,
-    INSIDE_NUMBER,
-    INSIDE_DOUBLE,
-    INSIDE_EXP,
-    AFTER_ESCAPE,
-    U_XXXX,
-    UX_XXX,
-    UXX_XX,
-    UXXX_X,
-    T_RUE,
-    TR_UE,
-    TRU_E,
-    F_ALSE,
-    FA_LSE,
-    FAL_SE,
-    FALS_E,
-    N_ULL,
-    NU_LL,
-    NUL_L;
-
-  void setError(Parser* parser, int pos) {
-    char message[80];
-    int len = parser->len - pos;
-    if (len > 20) len = 20;
-    std::string near(parser->data + pos, len);
-    std::replace(near.begin(), near.end(), '\n', '\0'); // 
-    snprintf(message, sizeof message, "line %d: syntax error near %s", parser->line, near.c_str());
-    parser->error = new std::string(message);
-  }
-
-  void inline error(Parser* parser, int pos, int cla) {
-    setError(parser, pos);
-  }
-
-  void inline numberOpen(Parser* parser, int pos, int cla) {
-    parser->beg = pos;
-    parser->state = INSIDE_NUMBER;
-  }
-
-  void inline doubleOpen(Parser* parser, int pos, int cla) {
-    parser->state = INSIDE_DOUBLE;
-  }
-
-  void inline expOpen(Parser* parser, int pos, int cla) {
-    parser->state = INSIDE_EXP;
-  }
-
-  void numberClose(Parser* parser, int pos, int cla) {
-    int beg = parser->beg;
-    parser->beg = -1;
-    char* p = parser->data + beg;
-    if (parser->keep.size() != 0) {
-      parser->keep.insert(parser->keep.end(), p, parser->data + pos + 1); // append stop byte
-      p = &parser->keep[0];
-    }
-    parser->frame->setValue(uni::NewNumber(parser->isolate, atof(p)));
-    parser->keep.clear();
-    parseFn fn = AFTER_VALUE[cla];
-    parser->state = AFTER_VALUE;
-    if (fn) fn(parser, pos, cla);
-  }
-
-  void inline stringOpen(Parser* parser, int pos, int cla) {
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
-  }
-
-  void stringClose(Parser* parser, int pos, int cla) {
-    char* p = parser->data + parser->beg;
-    size_t len = (size_t)(pos - parser->beg);
-    parser->beg = -1;
-    if (parser->keep.size() != 0) {
-      len += parser->keep.size();
-      parser->keep.insert(parser->keep.end(), p, parser->data + pos);
-      p = &parser->keep[0];
-    }
-    Frame* frame = parser->frame;
-
-    if (parser->needsKey) {
-      parser->keysCache->intern(parser, p, len, frame->key, parser->valuesCache, 0);
-      parser->needsKey = false;
-      parser->state = AFTER_KEY;
-    } else {
-      Local<Value> val;
-      parser->valuesCache->intern(parser, p, len, &val, NULL, 0);
-      frame->setValue(val);
-      parser->state = AFTER_VALUE;
+  inline Local<Array> columnArray(Frame* top, int i) {
+    return Local<Array>::Cast(Local<Array>::Cast(*top->value)->Get(i));
+  }
+
+  // returns false if the key does not match the column of the first record
+  bool columnKey(Parser* parser, Frame* top, char* p, size_t len, Encoding encoding) {
+    int i = parser->column;
+    Local<Value> key;
+    if (parser->records == 0) {
+      Column col;
+      col.name.assign(p, len);
+      col.encoding = encoding;
+      col.numeric = true;
+      col.ints = true;
+      parser->columns.push_back(col);
+      parser->keysCache->intern(parser, p, len, encoding, &key, true, 0);
+      Local<Array>::Cast(*top->key)->Set(i, key);
+      Local<Array>::Cast(*top->value)->Set(i, uni::NewArray(parser->isolate, 0));
+      return true;
     }
-    parser->keep.clear();
+    if (i >= (int)parser->columns.size()) return false;
+    Column& col = parser->columns[i];
+    if (col.encoding == encoding && col.name.size() == len && !memcmp(col.name.data(), p, len)) return true;
+    // same key may come with another encoding (or escaped) if the input mixes strings and buffers
+    parser->keysCache->intern(parser, p, len, encoding, &key, true, 0);
+    return key->StrictEquals(Local<Array>::Cast(*top->key)->Get(i));
   }
 
-  void inline escapeOpen(Parser* parser, int pos, int cla) {
-    parser->keep.insert(parser->keep.end(), parser->data + parser->beg, parser->data + pos);
-    parser->beg = -1;
-    parser->state = AFTER_ESCAPE;
+  void flushColumn(Parser* parser, Frame* top, int i) {
+    Column& col = parser->columns[i];
+    Local<Array> arr = columnArray(top, i);
+    for (size_t j = 0; j < col.numbers.size(); j++) arr->Set(j, uni::NewNumber(parser->isolate, col.numbers[j]));
+    col.numbers.clear();
+    col.numeric = false;
   }
 
-  void inline escapeB(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\b');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  void columnValue(Parser* parser, Frame* top, Local<Value> val) {
+    int i = parser->column++;
+    if (parser->columns[i].numeric) flushColumn(parser, top, i);
+    columnArray(top, i)->Set(parser->records, val);
   }
 
-  void inline escapeF(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\f');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  void columnNumber(Parser* parser, Frame* record, double val, bool isInt) {
+    Column& col = parser->columns[parser->column];
+    if (!col.numeric) return columnValue(parser, record->prev, uni::NewNumber(parser->isolate, val));
+    if (col.ints && !isInt32(val, isInt)) col.ints = false;
+    col.numbers.push_back(val);
+    parser->column++;
   }
 
-  void inline escapeR(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\r');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  Local<Object> columnRow(Parser* parser, Frame* top, int row, int count) {
+    Isolate* isolate = parser->isolate;
+    Local<Array> keys = Local<Array>::Cast(*top->key);
+    Local<Object> obj = uni::NewObject(isolate);
+    for (int i = 0; i < count; i++) {
+      Column& col = parser->columns[i];
+      if (col.numeric) obj->Set(keys->Get(i), uni::NewNumber(isolate, col.numbers[row]));
+      else obj->Set(keys->Get(i), columnArray(top, i)->Get(row));
+    }
+    return obj;
   }
 
-  void inline escapeN(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\n');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  // A record does not match: go back to an array of objects, including the record being parsed.
+  void uncolumnize(Parser* parser, Frame* top) {
+    Local<Array> rows = uni::NewArray(parser->isolate, parser->records);
+    for (int row = 0; row < parser->records; row++) rows->Set(row, columnRow(parser, top, row, (int)parser->columns.size()));
+    Frame* record = top->next;
+    if (record && record->record) {
+      *record->value = columnRow(parser, top, parser->records, parser->column);
+      record->record = false;
+    }
+    *top->value = rows;
+    top->columnar = false;
+    parser->columns.clear();
+    parser->records = 0;
   }
 
-  void inline escapeT(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\t');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  void columnsResult(Parser* parser, Frame* top) {
+    Isolate* isolate = parser->isolate;
+    if (parser->records == 0) {
+      *top->value = uni::NewArray(isolate, 0);
+    } else {
+      Local<Array> keys = Local<Array>::Cast(*top->key);
+      Local<Object> obj = uni::NewObject(isolate);
+      for (size_t i = 0; i < parser->columns.size(); i++) {
+        Column& col = parser->columns[i];
+        if (col.numeric) obj->Set(keys->Get(i), uni::NewTypedArray(isolate, &col.numbers[0], col.numbers.size(), col.ints));
+        else obj->Set(keys->Get(i), columnArray(top, i));
+      }
+      *top->value = obj;
+    }
+    top->columnar = false;
+    parser->columns.clear();
+    parser->records = 0;
   }
 
-  void inline escapeDQUOTE(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('"');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  void Parser::setNumber(double val, bool isInt) {
+    if (this->frame->numeric) this->frame->pushNumber(val, isInt);
+    else if (this->frame->record) columnNumber(this, this->frame, val, isInt);
+    else this->frame->setValue(uni::NewNumber(this->isolate, val));
   }
 
-  void inline escapeBSLASH(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('\\');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  void Parser::number(char* p, size_t len, bool isInt) {
+    this->stats.numbers++;
+    if (this->validateOnly) this->frame->skipValue();
+    else this->setNumber(atof(p), isInt);
   }
 
-  void inline escapeFSLASH(Parser* parser, int pos, int cla) {
-    parser->keep.push_back('/');
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+  // transforms: rules whose path matches the path of the value being parsed in frame, so far
+  inline uint32_t pathRules(Parser* parser, Frame* frame) {
+    uint32_t rules = frame->rules;
+    if (frame->depth == 0 || !rules) return rules;
+    if (frame->arrayPos < 0) return frame->keyRules;
+    std::vector<TransformRule>& all = parser->transforms.rules;
+    for (size_t i = 0; i < all.size(); i++) {
+      // global rules and shorter paths have no token at this depth, and are not in rules
+      if (!(rules & (1u << i))) continue;
+      TransformToken& token = all[i].tokens[frame->depth - 1];
+      if (!token.any && token.index != frame->arrayPos) rules &= ~(1u << i);
+    }
+    return rules;
   }
 
-  void inline u_xxxx(Parser* parser, int pos, int cla) {
-    parser->state = U_XXXX;
+  // rules which select the value being parsed in frame
+  uint32_t Parser::selected(Frame* frame) {
+    return (pathRules(this, frame) & this->transforms.exactAt(frame->depth)) | this->transforms.global;
   }
 
-  void inline ux_xxx(Parser* parser, int pos, int cla) {
-    parser->unicode = hex(parser->data[pos]);
-    parser->state = UX_XXX;
+  // key of the member being set in frame
+  Local<Value> Parser::memberKey(Frame* frame) {
+    uint32_t rules = this->selected(frame) & this->transforms.renames;
+    if (!rules) return *frame->key;
+    int i = 0;
+    while (!(rules & (1u << i))) i++;
+    this->stats.transformed++;
+    return uni::HandleToLocal(uni::Deref(this->isolate, this->transforms.renamed[i]));
   }
 
-  void inline uxx_xx(Parser* parser, int pos, int cla) {
-    parser->unicode = parser->unicode * 16 + hex(parser->data[pos]);
-    parser->state = UXX_XX;
+  // copies a short ASCII string to out, NUL terminated. Returns false if the string does not fit or is not ASCII.
+  inline bool shortAscii(char* p, size_t len, Encoding encoding, char* out) {
+    if (encoding == UTF16) {
+      len /= 2;
+      if (len >= TransformMaxSize) return false;
+      for (size_t i = 0; i < len; i++) {
+        uint16_t c = ((uint16_t*)p)[i];
+        if (c >= 0x80) return false;
+        out[i] = (char)c;
+      }
+    } else {
+      if (len >= TransformMaxSize) return false;
+      for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)p[i] >= 0x80) return false;
+        out[i] = p[i];
+      }
+    }
+    out[len] = 0;
+    return true;
   }
 
-  void inline uxxx_x(Parser* parser, int pos, int cla) {
-    parser->unicode = parser->unicode * 16 + hex(parser->data[pos]);
-    parser->state = UXXX_X;
+  // JSON number syntax. isInt is set if there is no fraction and no exponent.
+  bool isNumber(const char* s, bool* isInt) {
+    if (*s == '-') s++;
+    if (*s == '0') s++;
+    else if (*s >= '1' && *s <= '9') while (*s >= '0' && *s <= '9') s++;
+    else return false;
+    *isInt = *s != '.' && *s != 'e' && *s != 'E';
+    if (*s == '.') {
+      if (!(*++s >= '0' && *s <= '9')) return false;
+      while (*s >= '0' && *s <= '9') s++;
+    }
+    if (*s == 'e' || *s == 'E') {
+      if (*++s == '+' || *s == '-') s++;
+      if (!(*s >= '0' && *s <= '9')) return false;
+      while (*s >= '0' && *s <= '9') s++;
+    }
+    return *s == 0;
   }
 
-  void uxxxx_(Parser* parser, int pos, int cla) {
-    uint u = parser->unicode * 16 + hex(parser->data[pos]);
-    // push UTF-8 representation of u
-    if (u < 0x80) parser->keep.push_back((char)u);
-    else if (u < 0x0800) {
-      parser->keep.push_back(0xc0 + (u >> 6));
-      parser->keep.push_back(0x80 + (u & 0x3f));
-    } else {
-      parser->keep.push_back(0xe0 + (u >> 12));
-      parser->keep.push_back(0x80 + ((u >> 6) & 0x3f));
-      parser->keep.push_back(0x80 + (u & 0x3f));
+  // reads n digits, -1 if they are not all digits
+  inline int digits(const char*& s, int n) {
+    int val = 0;
+    for (int i = 0; i < n; i++, s++) {
+      if (!(*s >= '0' && *s <= '9')) return -1;
+      val = val * 10 + *s - '0';
     }
-    parser->beg = pos + 1;
-    parser->state = INSIDE_QUOTES;
+    return val;
   }
 
-  void inline t_rue(Parser* parser, int pos, int cla) {
-    parser->state = T_RUE;
+  // days from 1970-01-01 to y-m-d in the proleptic Gregorian calendar
+  inline double daysFromCivil(int y, int m, int d) {
+    if (m <= 2) y--;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097.0 + doe - 719468;
   }
 
-  void inline tr_ue(Parser* parser, int pos, int cla) {
-    parser->state = TR_UE;
+  // ISO-8601 date (2020-01-31, at midnight UTC) or date-time with a time zone (2020-01-31T12:00:00.000Z, 2020-01-31T14:00+02:00).
+  // Local date-times are rejected: they depend on the time zone of the process. Returns the time in ms since the epoch.
+  bool parseDate(const char* s, double* ms) {
+    static const int monthDays[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int y, m, d;
+    if ((y = digits(s, 4)) < 0 || *s++ != '-' || (m = digits(s, 2)) < 1 || m > 12 || *s++ != '-') return false;
+    if ((d = digits(s, 2)) < 1 || d > monthDays[m - 1]) return false;
+    if (m == 2 && d == 29 && (y % 4 != 0 || (y % 100 == 0 && y % 400 != 0))) return false;
+    double t = daysFromCivil(y, m, d) * 86400000.0;
+    if (*s == 0) {
+      *ms = t;
+      return true;
+    }
+    int h, mi, sec = 0, frac = 0;
+    if (*s++ != 'T' || (h = digits(s, 2)) < 0 || h > 23 || *s++ != ':' || (mi = digits(s, 2)) < 0 || mi > 59) return false;
+    if (*s == ':') {
+      s++;
+      if ((sec = digits(s, 2)) < 0 || sec > 59) return false;
+      if (*s == '.') {
+        // milliseconds, further digits are truncated
+        s++;
+        if (!(*s >= '0' && *s <= '9')) return false;
+        for (int scale = 100; *s >= '0' && *s <= '9'; s++, scale /= 10) frac += (*s - '0') * scale;
+      }
+    }
+    t += ((h * 60 + mi) * 60 + sec) * 1000.0 + frac;
+    if (*s == 'Z') {
+      s++;
+    } else if (*s == '+' || *s == '-') {
+      int sign = *s++ == '-' ? -1 : 1;
+      int oh, om;
+      if ((oh = digits(s, 2)) < 0 || oh > 23 || *s++ != ':' || (om = digits(s, 2)) < 0 || om > 59) return false;
+      t -= sign * (oh * 60 + om) * 60000.0;
+    } else {
+      return false;
+    }
+    if (*s != 0) return false;
+    *ms = t;
+    return true;
   }
 
-  void inline tru_e(Parser* parser, int pos, int cla) {
-    parser->state = TRU_E;
+  // date and number transforms. Returns false if the string value is not selected or not converted.
+  bool Parser::transformString(char* p, size_t len, Encoding encoding) {
+    uint32_t rules = this->selected(this->frame) & (this->transforms.numbers | this->transforms.dates);
+    char buf[TransformMaxSize];
+    if (!rules || !shortAscii(p, len, encoding, buf)) return false;
+    bool isInt;
+    double ms;
+    if ((rules & this->transforms.numbers) && isNumber(buf, &isInt)) {
+      this->stats.transformed++;
+      this->setNumber(atof(buf), isInt);
+      return true;
+    }
+    if ((rules & this->transforms.dates) && parseDate(buf, &ms)) {
+      this->stats.transformed++;
+      this->frame->setValue(uni::NewDate(this->isolate, ms));
+      return true;
+    }
+    return false;
   }
 
-  void inline true_(Parser* parser, int pos, int cla) {
-    parser->frame->setValue(uni::HandleToLocal(uni::True(parser->isolate)));
-    parser->state = AFTER_VALUE;
+  void Parser::key(char* p, size_t len, Encoding encoding) {
+    if (this->validateOnly) return;
+    Frame* frame = this->frame;
+    if (frame->rules) {
+      std::vector<TransformRule>& all = this->transforms.rules;
+      frame->keyRules = 0;
+      for (size_t i = 0; i < all.size(); i++) {
+        if ((frame->rules & (1u << i)) && all[i].tokens[frame->depth - 1].matches(p, len, encoding)) frame->keyRules |= 1u << i;
+      }
+    }
+    if (frame->record && !columnKey(this, frame->prev, p, len, encoding)) uncolumnize(this, frame->prev);
+    if (frame->record) return;
+    int i = frame->keyPos++;
+    if (!this->predictKeys || i >= MaxPredictedKeys || len > PredictedKeyMaxSize) {
+      this->keysCache->intern(this, p, len, encoding, frame->key, true, 0);
+      return;
+    }
+    if (!frame->predicted) {
+      frame->predicted = new PredictedKey[MaxPredictedKeys];
+      for (size_t j = 0; j < this->keyOrder.size() && j < MaxPredictedKeys; j++) {
+        PredictedKey& k = frame->predicted[j];
+        const std::string& name = this->keyOrder[j];
+        if (name.size() > PredictedKeyMaxSize) continue;
+        memcpy(k.bytes, name.data(), name.size());
+        k.len = (int)name.size();
+        uni::Reset(this->isolate, k.pvalue, uni::NewValue(this->isolate, uni::NewSymbol(this->isolate, name.data(), (int)name.size())));
+      }
+    }
+    PredictedKey& k = frame->predicted[i];
+    if ((size_t)k.len == len && k.encoding == encoding && !memcmp(p, k.bytes, len)) {
+      *frame->key = uni::HandleToLocal(uni::Deref(this->isolate, k.pvalue));
+      this->stats.keyPredictions++;
+      return;
+    }
+    // mismatch: the key of this object becomes the prediction
+    this->keysCache->intern(this, p, len, encoding, frame->key, true, 0);
+    uni::Reset(this->isolate, k.pvalue, *frame->key);
+    memcpy(k.bytes, p, len);
+    k.len = (int)len;
+    k.encoding = encoding;
   }
 
-  void inline f_alse(Parser* parser, int pos, int cla) {
-    parser->state = F_ALSE;
+  // external strings are one-byte: Latin-1 strings, or UTF-8 strings which are pure ASCII
+  inline bool isExternal(Parser* parser, char* p, size_t len, Encoding encoding) {
+    if (parser->externalMin == 0 || (int)len < parser->externalMin) return false;
+    return encoding == LATIN1 || (encoding == UTF8 && simd::isAscii(p, (int)len));
   }
 
-  void inline fa_lse(Parser* parser, int pos, int cla) {
-    parser->state = FA_LSE;
+  Local<Value> newExternalString(Parser* parser, char* p, size_t len) {
+    Slab* slab = parser->slab;
+    if (!slab || slab->size - slab->used < len) {
+      if (slab) slab->release();
+      slab = parser->slab = new Slab(std::max((size_t)SlabSize, len));
+    }
+    char* data = slab->data + slab->used;
+    memcpy(data, p, len);
+    slab->used += len;
+    parser->stats.externalStrings++;
+    return uni::NewExternalOneByteString(parser->isolate, new ExternalString(slab, data, len));
   }
 
-  void inline fal_se(Parser* parser, int pos, int cla) {
-    parser->state = FAL_SE;
+  void Parser::string(char* p, size_t len, Encoding encoding) {
+    this->stats.strings++;
+    if (this->validateOnly) return this->frame->skipValue();
+    if ((this->transforms.numbers | this->transforms.dates) && this->transformString(p, len, encoding)) return;
+    Local<Value> val;
+    if (isExternal(this, p, len, encoding)) val = newExternalString(this, p, len);
+    else this->valuesCache->intern(this, p, len, encoding, &val, false, 0);
+    this->frame->setValue(val);
   }
 
-  void inline fals_e(Parser* parser, int pos, int cla) {
-    parser->state = FALS_E;
+  void Parser::boolean(bool val) {
+    this->stats.booleans++;
+    if (this->validateOnly) this->frame->skipValue();
+    else this->frame->setValue(uni::HandleToLocal(val ? uni::True(this->isolate) : uni::False(this->isolate)));
   }
 
-  void inline false_(Parser* parser, int pos, int cla) {
-    parser->frame->setValue(uni::HandleToLocal(uni::False(parser->isolate)));
-    parser->state = AFTER_VALUE;
+  void Parser::null() {
+    this->stats.nulls++;
+    Frame* frame = this->frame;
+    if (this->validateOnly) frame->skipValue();
+    else if (this->transforms.dropNulls && frame->arrayPos < 0 && (this->selected(frame) & this->transforms.dropNulls)) this->stats.transformed++;
+    else frame->setValue(uni::HandleToLocal(uni::Null(this->isolate)));
   }
 
-  void inline n_ull(Parser* parser, int pos, int cla) {
-    parser->state = N_ULL;
+  // ndjson mode: the frames of the line with a syntax error are dropped, and so are the values that it completed before
+  void Parser::discard() {
+    while (this->frame->prev) this->frame = this->frame->prev;
+    this->columns.clear();
+    this->records = 0;
+    this->column = 0;
+    Frame* root = this->frame;
+    if (this->markLine != this->tokenizer.lineStart) return;
+    if (!this->validateOnly) {
+      // values returned by the callback were stored, the callback itself cannot be undone
+      Local<Object> arr = Local<Object>::Cast(*root->value);
+      arr->Set(uni::NewSymbol(this->isolate, "length"), uni::NewNumber(this->isolate, this->markLength));
+    }
+    root->arrayPos = this->markPos;
+    this->markLine = 0;
   }
 
-  void inline nu_ll(Parser* parser, int pos, int cla) {
-    parser->state = NU_LL;
+  // ndjson mode: called before a top-level value is set. The first one of a line marks the root array.
+  void Parser::markValue(Frame* root) {
+    if (this->markLine == this->tokenizer.lineStart) return;
+    this->markLine = this->tokenizer.lineStart;
+    this->markLength = this->validateOnly ? 0 : Local<Array>::Cast(*root->value)->Length();
+    this->markPos = root->arrayPos;
   }
 
-  void inline nul_l(Parser* parser, int pos, int cla) {
-    parser->state = NUL_L;
+  void Parser::arrayOpen() {
+    Frame* frame = this->frame->next;
+    if (frame == NULL) frame = new Frame(this, this->frame, true);
+    else frame->clear();
+    frame->rules = pathRules(this, this->frame) & this->transforms.deeperAt(this->frame->depth);
+    this->frame = frame;
+    frame->arrayPos = 0;
+    // elements that go through the callback are never collected as numbers
+    frame->numeric = this->typedArrays && !this->validateOnly && frame->depth > this->callbackDepth;
+    frame->ints = true;
+    frame->numbers.clear();
+    // columnar only applies to the top-level array, and only if records are not passed to the callback or reshaped by transforms
+    frame->columnar = this->columnar && !this->validateOnly && frame->depth == 1 && this->callbackDepth < 1 &&
+      !(this->transforms.renames | this->transforms.dropNulls);
+    frame->record = false;
+    if (frame->columnar) {
+      frame->numeric = false;
+      this->columns.clear();
+      this->records = 0;
+      *frame->value = uni::NewArray(this->isolate, 0);
+      *frame->key = uni::NewArray(this->isolate, 0);
+    } else if (!this->validateOnly && !frame->numeric) {
+      *frame->value = uni::NewArray(this->isolate, 0);
+    }
+    this->stats.arrays++;
+    if (frame->depth > this->stats.maxDepth) this->stats.maxDepth = frame->depth;
   }
 
-  void inline null_(Parser* parser, int pos, int cla) {
-    parser->frame->setValue(uni::HandleToLocal(uni::Null(parser->isolate)));
-    parser->state = AFTER_VALUE;
+  void Parser::arrayClose() {
+    Frame* frame = this->frame;
+    if (frame->numeric) frame->typedArray();
+    else if (frame->columnar) columnsResult(this, frame);
+    this->frame = frame->prev;
+    if (this->validateOnly) this->frame->skipValue();
+    else this->frame->setValue(*frame->value);
   }
 
-  void arrayOpen(Parser* parser, int pos, int cla) {
-    Frame* frame = parser->frame->next;
-    if (frame == NULL) frame = new Frame(parser, parser->frame, true);
-    parser->frame = frame;
-    frame->arrayPos = 0;
-    *frame->value = uni::NewArray(parser->isolate, 0);
-    frame->needsValue = false;
-    parser->needsKey = false;
-    parser->state = BEFORE_VALUE;
-  }
-
-  void arrayClose(Parser* parser, int pos, int cla) {
-    if (parser->frame->arrayPos == -1) return setError(parser, pos);
-    if (parser->frame->needsValue) return setError(parser, pos);
-    Local<Value> val = *parser->frame->value;
-    parser->frame = parser->frame->prev;
-    if (parser->frame == NULL) return setError(parser, pos);
-    parser->frame->setValue(val);
-    parser->state = AFTER_VALUE;
-  }
-
-  void objectOpen(Parser* parser, int pos, int cla) {
-    Frame* frame = parser->frame->next;
-    if (frame == NULL) frame = new Frame(parser, parser->frame, true);
-    parser->frame = frame;
+  void Parser::objectOpen() {
+    Frame* frame = this->frame->next;
+    if (frame == NULL) frame = new Frame(this, this->frame, true);
+    else frame->clear();
+    frame->rules = pathRules(this, this->frame) & this->transforms.deeperAt(this->frame->depth);
+    frame->record = this->frame->columnar;
+    frame->columnar = false;
+    frame->numeric = false;
+    this->frame = frame;
     frame->arrayPos = -1;
-    *frame->value = uni::NewObject(parser->isolate);
-    frame->needsValue = false;
-    parser->needsKey = true;
-    parser->state = BEFORE_KEY;
+    frame->keyPos = 0;
+    if (frame->record) this->column = 0;
+    else if (!this->validateOnly) *frame->value = uni::NewObject(this->isolate);
+    this->stats.objects++;
+    if (frame->depth > this->stats.maxDepth) this->stats.maxDepth = frame->depth;
   }
 
-  void objectClose(Parser* parser, int pos, int cla) {
-    if (parser->frame->arrayPos >= 0) return setError(parser, pos);
-    if (parser->frame->needsValue) return setError(parser, pos);
-    Local<Value> val = *parser->frame->value;
-    parser->frame = parser->frame->prev;
-    if (parser->frame == NULL) return setError(parser, pos);
-    parser->frame->setValue(val);
-    parser->state = AFTER_VALUE;
+  void Parser::objectClose() {
+    Frame* frame = this->frame;
+    if (frame->record) {
+      // the first record sets the shape, the others must have the same keys in the same order
+      if (this->column == 0 || (this->records > 0 && this->column != (int)this->columns.size())) {
+        uncolumnize(this, frame->prev);
+      } else {
+        frame->record = false;
+        this->records++;
+        this->frame = frame->prev;
+        this->frame->skipValue();
+        return;
+      }
+    }
+    this->frame = frame->prev;
+    if (this->validateOnly) this->frame->skipValue();
+    else this->frame->setValue(*frame->value);
   }
 
-  void inline eatColon(Parser* parser, int pos, int cla) {
-    parser->state = BEFORE_VALUE;
+  // API
+  Persistent<FunctionTemplate> Parser::constructorTemplate;
+
+  // decodes the argument of update. Returns false if it is neither a buffer nor a string.
+  bool Parser::decode(Local<Value> arg, Input& in) {
+    in.data = NULL;
+    in.wdata = NULL;
+    if (arg->IsString()) {
+      // V8 only exposes the characters of external strings.
+      // Other strings are flattened into a scratch buffer (memcpy, no re-encoding).
+      // Strings are immutable, so the copy is reused when update() resumes on the same string after a pause.
+      Local<String> str = Local<String>::Cast(arg);
+      in.len = str->Length();
+      bool flat = !this->flattened.IsEmpty() && uni::Deref(this->isolate, this->flattened) == str;
+      if (uni::IsOneByte(str)) {
+        in.encoding = LATIN1;
+        in.data = (char*)uni::ExternalOneByteData(str);
+        if (in.data == NULL) {
+          if (!flat) {
+            if (this->scratch.size() < (size_t)in.len + 1) this->scratch.resize(in.len + 1);
+            uni::WriteOneByte(str, (uint8_t*)&this->scratch[0], in.len);
+            uni::Reset(this->isolate, this->flattened, str);
+          }
+          in.data = &this->scratch[0];
+        }
+      } else {
+        in.encoding = UTF16;
+        if (!flat) {
+          if (this->wscratch.size() < (size_t)in.len + 1) this->wscratch.resize(in.len + 1);
+          uni::WriteTwoByte(str, &this->wscratch[0], in.len);
+          uni::Reset(this->isolate, this->flattened, str);
+        }
+        in.wdata = &this->wscratch[0];
+      }
+    } else if (arg->IsObject() && Buffer::HasInstance(arg)) {
+      in.buf = Local<Object>::Cast(arg);
+      in.encoding = UTF8;
+      in.data = Buffer::Data(in.buf);
+      in.len = (int)Buffer::Length(in.buf);
+    } else {
+      return false;
+    }
+    return true;
   }
 
-  void inline eatComma(Parser* parser, int pos, int cla) {
-    Frame* frame = parser->frame;
-    if (frame->arrayPos >= 0) {
-      parser->state = BEFORE_VALUE;
+  // feeds the input to the tokenizer. Frames must be restored and caches allocated, unless validateOnly is set.
+  int Parser::parse(Input& in) {
+    int pos;
+    if (this->validateOnly && in.encoding == UTF8 && !this->utf8.update(in.data, in.len)) {
+      // UTF-8 is checked up front by the SIMD validator, the state machine only checks the syntax.
+      this->tokenizer.fail("invalid UTF-8 sequence");
+      pos = 0;
     } else {
-      parser->state = BEFORE_KEY;
-      parser->needsKey = true;
-    }
-    frame->needsValue = true;
-  }
-
-  void inline eatNL(Parser* parser, int pos, int cla) {
-    parser->line++;
-  }
-
-  int initStates() {
-    Transition BEFORE_VALUE_TRANSITIONS[] = {
-      { CURLY_OPEN, objectOpen },
-      { SQUARE_OPEN, arrayOpen },
-      { DQUOTE, stringOpen },
-      { MINUS, numberOpen },
-      { DIGIT, numberOpen },
-      { t_, t_rue },
-      { f_, f_alse },
-      { n_, n_ull },
-      { SPACE, NULL },
-      { NL, eatNL },
-      { SQUARE_CLOSE, arrayClose },
-      { -1, NULL }
-    };
-    BEFORE_VALUE = makeState(BEFORE_VALUE_TRANSITIONS, error);
-
-    Transition AFTER_VALUE_TRANSITIONS[] = {
-      { COMMA, eatComma },
-      { CURLY_CLOSE, objectClose },
-      { SQUARE_CLOSE, arrayClose },
-      { SPACE, NULL },
-      { NL, eatNL },
-      { -1, NULL }
-    };
-    AFTER_VALUE = makeState(AFTER_VALUE_TRANSITIONS, error);
-
-    // object states
-    Transition BEFORE_KEY_TRANSITIONS[] = {
-      { DQUOTE, stringOpen },
-      { CURLY_CLOSE, objectClose },
-      { SPACE, NULL },
-      { NL, eatNL },
-      { -1, NULL }
-    };
-    BEFORE_KEY = makeState(BEFORE_KEY_TRANSITIONS, error);
-
-    Transition AFTER_KEY_TRANSITIONS[] = {
-      { COLON, eatColon },
-      { SPACE, NULL },
-      { NL, eatNL },
-      { -1, NULL }
-    };
-    AFTER_KEY = makeState(AFTER_KEY_TRANSITIONS, error);
-
-    // string states
-    Transition INSIDE_QUOTES_TRANSITIONS[] = {
-      { DQUOTE, stringClose },
-      { BSLASH, escapeOpen },
-      { NL, error },
-      { -1, NULL }
-    };
-    INSIDE_QUOTES = makeState(INSIDE_QUOTES_TRANSITIONS, NULL);
-
-    Transition AFTER_ESCAPE_TRANSITIONS[] = {
-      { b_, escapeB },
-      { f_, escapeF },
-      { n_, escapeN },
-      { r_, escapeR },
-      { t_, escapeT },
-      { DQUOTE, escapeDQUOTE },
-      { BSLASH, escapeBSLASH },
-      { FSLASH, escapeFSLASH },
-      { u_, u_xxxx }, 
-      { -1, NULL }
-    };
-    AFTER_ESCAPE = makeState(AFTER_ESCAPE_TRANSITIONS, error);
-
-    U_XXXX = makeHexState(ux_xxx, error);
-    UX_XXX = makeHexState(uxx_xx, error);
-    UXX_XX = makeHexState(uxxx_x, error);
-    UXXX_X = makeHexState(uxxxx_, error);
-    
-    Transition T_RUE_TRANSITIONS[] = {
-      { r_, tr_ue },
-      { -1, NULL }
-    };
-    T_RUE = makeState(T_RUE_TRANSITIONS, error);
-    
-    Transition TR_UE_TRANSITIONS[] = {
-      { u_, tru_e },
-      { -1, NULL }
-    };
-    TR_UE = makeState(TR_UE_TRANSITIONS, error);
-    
-    Transition TRU_E_TRANSITIONS[] = {
-      { e_, true_ },
-      { -1, NULL }
-    };
-    TRU_E = makeState(TRU_E_TRANSITIONS, error);
-    
-    Transition F_ALSE_TRANSITIONS[] = {
-      { a_, fa_lse },
-      { -1, NULL }
-    };
-    F_ALSE = makeState(F_ALSE_TRANSITIONS, error);
-    
-    Transition FA_LSE_TRANSITIONS[] = {
-      { l_, fal_se },
-      { -1, NULL }
-    };
-    FA_LSE = makeState(FA_LSE_TRANSITIONS, error);
-    
-    Transition FAL_SE_TRANSITIONS[] = {
-      { s_, fals_e },
-      { -1, NULL }
-    };
-    FAL_SE = makeState(FAL_SE_TRANSITIONS, error);
-    
-    Transition FALS_E_TRANSITIONS[] = {
-      { e_, false_ },
-      { -1, NULL }
-    };
-    FALS_E = makeState(FALS_E_TRANSITIONS, error);
-    
-    Transition N_ULL_TRANSITIONS[] = {
-      { u_, nu_ll },
-      { -1, NULL }
-    };
-    N_ULL = makeState(N_ULL_TRANSITIONS, error);
-    
-    Transition NU_LL_TRANSITIONS[] = {
-      { l_, nul_l },
-      { -1, NULL }
-    };
-    NU_LL = makeState(NU_LL_TRANSITIONS, error);
-    
-    Transition NUL_L_TRANSITIONS[] = {
-      { l_, null_ },
-      { -1, NULL }
-    };
-    NUL_L = makeState(NUL_L_TRANSITIONS, error);
-    
-    // number transition - a bit loose, let parse handle errors
-    Transition INSIDE_NUMBER_TRANSITIONS[] = {
-      { DIGIT, NULL },
-      { DOT, doubleOpen },
-      { e_, expOpen },
-      { E_, expOpen },
-      { -1, NULL }
-    };
-    INSIDE_NUMBER = makeState(INSIDE_NUMBER_TRANSITIONS, numberClose);
-
-    Transition INSIDE_DOUBLE_TRANSITIONS[] = {
-      { DIGIT, NULL },
-      { e_, expOpen },
-      { E_, expOpen },
-      { -1, NULL }
-    };
-    INSIDE_DOUBLE = makeState(INSIDE_DOUBLE_TRANSITIONS, numberClose);
-
-
-    Transition INSIDE_EXP_TRANSITIONS[] = {
-      { PLUS, NULL },
-      { MINUS, NULL },
-      { DIGIT, NULL },
-      { -1, NULL }
-    };
-    INSIDE_EXP = makeState(INSIDE_EXP_TRANSITIONS, numberClose);
-
-    return 0;
-  }
-
-  int dummy3 = initStates();
-
-  int parse(Parser* parser, char* buf, int len) {
-    parser->data = buf;
-    parser->len = len;
-    int pos = 0;
-    while (pos < len && !parser->error) {
-      int ch = buf[pos] & 0xff;
-      int cla = classes[ch];
-      parseFn fn = parser->state[cla];
-      if (fn != NULL) fn(parser, pos, cla);
-      pos++;
+      pos = in.wdata ? this->tokenizer.update(in.wdata, in.len) : this->tokenizer.update(in.data, in.len, in.encoding);
     }
     return pos;
   }
 
-  // API
-  Persistent<FunctionTemplate> Parser::constructorTemplate;
+  // parses a chunk, with the caches and frames set up
+  int Parser::run(Input& in) {
+    Isolate* isolate = this->isolate;
+    IJSON_PROBE1(update__start, in.len);
+#ifdef IJSON_TRACE
+    uint64_t t0 = uv_hrtime();
+#endif
+
+    int pos;
+    if (this->validateOnly) {
+      // no values, so no caches and no frames to restore.
+      pos = this->parse(in);
+    } else {
+      int cacheLen = in.len / 16;
+      if (cacheLen < 2) cacheLen = 2;
+      else if (cacheLen > 512) cacheLen = 512;
 
-  uni::CallbackType Parser::Update(const uni::FunctionCallbackInfo& args) {
-    UNI_SCOPE(scope);
-    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
-    Isolate* isolate = parser->isolate;
-    if (args.Length() < 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
-    if (!args[0]->IsObject() || !Buffer::HasInstance(args[0])) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: buffer expected")));
-    
-    Local<Object> buf = Local<Object>::Cast(args[0]);
-    char* data = Buffer::Data(buf);
-    int len = (int)Buffer::Length(buf);
+      this->keysCache->clear(cacheLen);
+      this->valuesCache->clear(cacheLen);
+      this->warmKeys->hits = 0;
+      this->warmKeys->misses = 0;
 
-    int cacheLen = len / 16;
-    if (cacheLen < 2) cacheLen = 2;
-    else if (cacheLen > 512) cacheLen = 512;
+      for (Frame* f = this->frame; f; f = f->prev) f->restore(isolate);
 
-    parser->keysCache = new Cache(cacheLen);
-    parser->valuesCache = new Cache(cacheLen);
+      pos = this->parse(in);
 
-    for (Frame* f = parser->frame; f; f = f->prev) f->restore(isolate);
+      for (Frame* f = this->frame; f; f = f->prev) f->save(isolate);
 
-    int pos = parse(parser, data, len);
+      // keys missed by the update cache may still hit the warm cache
+      this->stats.keyHits += this->keysCache->hits + this->warmKeys->hits;
+      this->stats.keyMisses += this->warmKeys->misses;
+      this->stats.valueHits += this->valuesCache->hits;
+      this->stats.valueMisses += this->valuesCache->misses;
+    }
 
-    for (Frame* f = parser->frame; f; f = f->prev) f->save(isolate);
+#ifdef IJSON_TRACE
+    this->tokenizer.trace.update(uv_hrtime() - t0);
+#endif
+    IJSON_PROBE1(update__done, pos);
+    return pos;
+  }
+
+  // parses the coalesced chunks. The bytes after a pause stay pending.
+  void Parser::flush() {
+    if (this->pending.empty()) return;
+    Input in;
+    in.data = &this->pending[0];
+    in.wdata = NULL;
+    in.encoding = UTF8;
+    in.len = (int)this->pending.size();
+    int pos = this->run(in);
+    if (this->tokenizer.error) this->pending.clear();
+    else this->pending.erase(this->pending.begin(), this->pending.begin() + pos);
+    this->pendingPaused = !this->pending.empty();
+  }
 
-    if (parser->frame) {
-      delete parser->frame->next;
-      parser->frame->next = NULL;
+  // inflate option: the input is decompressed into the window, which is parsed by fn (run or parse) each time it is full.
+  // So the inflated document is never held in memory.
+  // After a pause, the rest of the window is kept for the next call and the compressed input which was not read yet
+  // is left to the caller. Returns the number of compressed bytes read.
+  int Parser::inflate(Input& in, int (Parser::*fn)(Input&)) {
+    if (!this->parseWindow(fn)) return 0;
+    z_stream* zs = this->zstream;
+    zs->next_in = (Bytef*)in.data;
+    zs->avail_in = in.len;
+    while (!this->tokenizer.error) {
+      if (this->inflated) {
+        // gzip streams may have several members
+        if (zs->avail_in == 0) break;
+        inflateReset(zs);
+        this->inflated = false;
+      }
+      zs->next_out = (Bytef*)&this->window[0];
+      zs->avail_out = (uInt)this->window.size();
+      int ret = ::inflate(zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        this->inflated = true;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        std::string message = std::string("invalid compressed input: ") + (zs->msg ? zs->msg : "inflate failed");
+        this->tokenizer.fail(message.c_str());
+        break;
+      }
+      this->windowPos = 0;
+      this->windowLen = (int)(this->window.size() - zs->avail_out);
+      if (!this->parseWindow(fn)) break;
+      // window not filled: all the input has been consumed
+      if (!this->inflated && zs->avail_out != 0) break;
     }
+    int len = in.len - (int)zs->avail_in;
+    this->stats.compressedBytes += len;
+    return len;
+  }
 
-    delete parser->keysCache;
-    delete parser->valuesCache;
+  // parses the inflated bytes left in the window. Returns false if the parser paused before their end, or failed.
+  bool Parser::parseWindow(int (Parser::*fn)(Input&)) {
+    if (this->windowPos == this->windowLen) return true;
+    Input out;
+    out.data = &this->window[this->windowPos];
+    out.wdata = NULL;
+    out.encoding = UTF8;
+    out.len = this->windowLen - this->windowPos;
+    this->windowPos += (this->*fn)(out);
+    return this->windowPos == this->windowLen && !this->tokenizer.error;
+  }
 
-    if (parser->error) {
-      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, parser->error->c_str())));
+  // parses a chunk of the input, compressed or coalesced depending on the options.
+  // Returns the number of chars consumed, less than in.len if the parser paused.
+  int Parser::feed(Input& in) {
+    if (this->zstream) return this->inflate(in, &Parser::run);
+    // paused in the pending bytes: the chunk waits behind them and is not consumed at all, until they have been parsed
+    if (this->pendingPaused) {
+      this->flush();
+      if (this->tokenizer.error || this->pendingPaused) return 0;
+    }
+    if (this->coalesce && in.encoding == UTF8 && in.len < this->coalesce) {
+      // small buffer: it is only parsed when enough bytes are pending, or when the first pending one has waited too long
+      if (this->pending.empty()) this->pendingSince = uv_hrtime();
+      this->pending.insert(this->pending.end(), in.data, in.data + in.len);
+      this->stats.coalesced++;
+      if (this->pending.size() >= (size_t)this->coalesce ||
+        (this->coalesceDelay && uv_hrtime() - this->pendingSince >= this->coalesceDelay)) this->flush();
+      if (!this->pendingPaused) return in.len;
+      // the bytes of the chunk which were not parsed are left to the caller
+      int left = (int)std::min(this->pending.size(), (size_t)in.len);
+      this->pending.resize(this->pending.size() - left);
+      this->pendingPaused = !this->pending.empty();
+      return in.len - left;
     }
-    if (parser->beg != -1) {
-      parser->keep.insert(parser->keep.end(), parser->data + parser->beg, parser->data + pos);
-      parser->beg = 0;
+    this->flush();
+    if (this->tokenizer.error || this->pendingPaused) return 0;
+    return this->run(in);
+  }
+
+  // feeds the whole chunk, resuming after pauses
+  void Parser::feedAll(Input& in) {
+    while (in.len > 0 && !this->tokenizer.error) {
+      int pos = this->feed(in);
+      in.data += pos;
+      in.len -= pos;
     }
+  }
 
-    parser->data = NULL;
+  // parses a file in large windows, without reading it into a buffer.
+  // The file is mapped with a sequential hint and the pages of each window are dropped once parsed, so that a
+  // multi-GB file only costs a window of memory. Returns false (with errno set) if the file cannot be read.
+  bool Parser::parseFile(const char* path) {
+    Input in;
+    in.wdata = NULL;
+    in.encoding = UTF8;
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    std::vector<char> window(FileWindowSize);
+    in.data = &window[0];
+    while (!this->tokenizer.error && (in.len = (int)fread(in.data, 1, window.size(), file)) > 0) this->feedAll(in);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    char* map = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) < 0) map = (char*)MAP_FAILED;
+    else if ((size = (size_t)st.st_size) > 0) map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    errno = err;
+    if (map == (char*)MAP_FAILED) return false;
+    if (map) madvise(map, size, MADV_SEQUENTIAL);
+    for (size_t pos = 0; pos < size && !this->tokenizer.error; pos += FileWindowSize) {
+      in.data = map + pos;
+      in.len = (int)std::min(size - pos, (size_t)FileWindowSize);
+      this->feedAll(in);
+      madvise(map + pos, std::min(size - pos, (size_t)FileWindowSize), MADV_DONTNEED);
+    }
+    if (map) munmap(map, size);
+    return true;
+#endif
+  }
 
+  uni::CallbackType Parser::UpdateFile(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[0]->IsString()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: string expected")));
+    String::Utf8Value path(args[0]);
+    if (!parser->parseFile(*path)) {
+      std::string message = std::string("cannot read ") + *path + ": " + strerror(errno);
+      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, message.c_str())));
+    }
+    if (parser->tokenizer.error) {
+      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, parser->tokenizer.error->c_str())));
+    }
+    UNI_RETURN(scope, args, uni::Undefined(isolate));
+  }
+
+  uni::CallbackType Parser::Update(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() < 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+
+    Input in;
+    if (!parser->decode(args[0], in)) {
+      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: buffer or string expected")));
+    }
+    if (parser->zstream && in.encoding != UTF8) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: buffer expected")));
+    // optional start offset, to resume after a pause without slicing the input
+    int start = 0;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      if (!args[1]->IsNumber() || args[1]->Int32Value() < 0 || args[1]->Int32Value() > in.len) {
+        UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 2: offset expected")));
+      }
+      start = args[1]->Int32Value();
+      if (in.wdata) in.wdata += start;
+      else in.data += start;
+      in.len -= start;
+    }
+    int pos = parser->feed(in);
+    // the flattened copy is only kept for the rest of a paused string
+    if (pos == in.len) uni::Dispose(isolate, parser->flattened);
+
+    if (parser->tokenizer.error) {
+      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, parser->tokenizer.error->c_str())));
+    }
+    // offset reached: the end of the input, unless the parser paused
+    UNI_RETURN(scope, args, uni::NewInteger(isolate, start + pos));
+  }
+
+  uni::CallbackType Parser::Pause(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    // validateOnly checks the UTF-8 of whole chunks, so it never pauses
+    if (!parser->validateOnly) parser->tokenizer.pause();
+    UNI_RETURN(scope, args, uni::Undefined(isolate));
+  }
+
+  uni::CallbackType Parser::Flush(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    parser->flush();
+    if (parser->tokenizer.error) {
+      UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, parser->tokenizer.error->c_str())));
+    }
     UNI_RETURN(scope, args, uni::Undefined(isolate));
   }
 
@@ -820,17 +1503,37 @@ namespace ijson {
     Isolate* isolate = parser->isolate;
     if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
 
-    if (parser->frame->prev) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "Unexpected end of input")));
-    
-    // number values are only closed when we read past them. So we parse an extra space if still inside a number.
-    if (parser->state == INSIDE_NUMBER || parser->state == INSIDE_DOUBLE || parser->state == INSIDE_EXP) {
-      parser->frame->restore(isolate);
-      parse(parser, (char*)" ", 1);
-      parser->frame->save(isolate);
+    while (!parser->pending.empty() && !parser->tokenizer.error) parser->flush();
+    if (parser->zstream) {
+      // inflated bytes which were left after a pause, and the output that zlib still holds
+      Input none;
+      none.data = NULL;
+      none.wdata = NULL;
+      none.encoding = UTF8;
+      none.len = 0;
+      do {
+        parser->inflate(none, &Parser::run);
+      } while (parser->windowPos < parser->windowLen && !parser->tokenizer.error);
+    }
+    if (parser->zstream && !parser->inflated) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "Unexpected end of compressed input")));
+    // may close a number value, or drop the frames of a cut line in ndjson mode, so all the frames must be restored
+    if (!parser->validateOnly) for (Frame* f = parser->frame; f; f = f->prev) f->restore(isolate);
+    bool ok = parser->tokenizer.end();
+    if (!parser->validateOnly) for (Frame* f = parser->frame; f; f = f->prev) f->save(isolate);
+    if (!ok) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, parser->tokenizer.error->c_str())));
+    if (parser->validateOnly) {
+      if (!parser->utf8.complete()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "invalid UTF-8 sequence")));
+      if (parser->frame->arrayPos > 1 && !parser->tokenizer.ndjson) {
+        char message[80];
+        snprintf(message, sizeof message, "Too many results: %d", parser->frame->arrayPos);
+        UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, message)));
+      }
+      UNI_RETURN(scope, args, uni::True(isolate));
     }
-    if (parser->state != AFTER_VALUE) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "Unexpected end of input")));
     Local<Array> arr = Local<Array>::Cast(uni::HandleToLocal(uni::Deref(isolate, parser->frame->pvalue)));
     uni::Dispose(isolate, parser->frame->pvalue);
+    // ndjson mode: the values of all the lines
+    if (parser->tokenizer.ndjson) UNI_RETURN(scope, args, arr);
     if (arr->Length() > 1) {
       char message[80];
       snprintf(message, sizeof message, "Too many results: %d", arr->Length());
@@ -839,6 +1542,139 @@ namespace ijson {
     UNI_RETURN(scope, args, arr->Get(0));
   }
 
+  uni::CallbackType Parser::Reset(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    parser->reset();
+    // result() disposes the root value
+    uni::Reset(isolate, parser->frame->pvalue, uni::NewValue(isolate, uni::NewArray(isolate, 0)));
+    UNI_RETURN(scope, args, uni::Undefined(isolate));
+  }
+
+  // ndjson mode: returns the syntax errors as { message, line, offset } objects, and clears them
+  Local<Array> takeErrors(Isolate* isolate, std::vector<core::SyntaxError>& errors) {
+    Local<Array> arr = uni::NewArray(isolate, (int)errors.size());
+    for (size_t i = 0; i < errors.size(); i++) {
+      Local<Object> obj = uni::NewObject(isolate);
+      obj->Set(uni::NewSymbol(isolate, "message"), uni::NewString(isolate, errors[i].message.c_str()));
+      obj->Set(uni::NewSymbol(isolate, "line"), uni::NewInteger(isolate, errors[i].line));
+      obj->Set(uni::NewSymbol(isolate, "offset"), uni::NewNumber(isolate, (double)errors[i].offset));
+      arr->Set(i, obj);
+    }
+    errors.clear();
+    return arr;
+  }
+
+  // parses a batch of documents with a single native parser and shared caches.
+  // A document which cannot be parsed gets an Error in the results.
+  uni::CallbackType Parser::ParseMany(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Isolate* isolate = Isolate::GetCurrent();
+    if (args.Length() != 2) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[0]->IsArray()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: array expected")));
+    if (!args[1]->IsObject()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 2: object expected")));
+    Local<Array> inputs = Local<Array>::Cast(args[0]);
+    uint32_t count = inputs->Length();
+    Local<Array> results = uni::NewArray(isolate, count);
+
+    Parser parser;
+    parser.setOptions(isolate, Local<Object>::Cast(args[1]));
+    parser.tokenizer.pauseEvery(0, 0);
+    parser.keysCache->clear(512);
+    parser.valuesCache->clear(512);
+    Frame* root = parser.frame;
+    root->restore(isolate);
+    Input in;
+    for (uint32_t i = 0; i < count; i++) {
+      parser.reset();
+      if (!parser.validateOnly) *root->value = uni::NewArray(isolate, 0);
+      if (!parser.decode(inputs->Get(i), in)) parser.tokenizer.fail("bad input: buffer or string expected");
+      else if (!parser.zstream) parser.parse(in);
+      else if (in.encoding != UTF8) parser.tokenizer.fail("bad input: buffer expected");
+      else {
+        parser.inflate(in, &Parser::parse);
+        if (!parser.inflated) parser.tokenizer.fail("Unexpected end of compressed input");
+      }
+      if (parser.tokenizer.end()) {
+        if (root->arrayPos > 1 && !parser.tokenizer.ndjson) {
+          char message[80];
+          snprintf(message, sizeof message, "Too many results: %d", root->arrayPos);
+          parser.tokenizer.fail(message);
+        }
+        else if (parser.validateOnly && !parser.utf8.complete()) parser.tokenizer.fail("invalid UTF-8 sequence");
+      }
+      if (parser.tokenizer.error) results->Set(i, Exception::Error(uni::NewString(isolate, parser.tokenizer.error->c_str())));
+      else if (parser.validateOnly) results->Set(i, uni::True(isolate));
+      else if (parser.tokenizer.ndjson) {
+        // the values of the lines, and the errors of the lines which were skipped
+        Local<Object> obj = uni::NewObject(isolate);
+        obj->Set(uni::NewSymbol(isolate, "values"), *root->value);
+        obj->Set(uni::NewSymbol(isolate, "errors"), takeErrors(isolate, parser.tokenizer.errors));
+        results->Set(i, obj);
+      }
+      else results->Set(i, Local<Array>::Cast(*root->value)->Get(0));
+    }
+    UNI_RETURN(scope, args, results);
+  }
+
+  uni::CallbackType Parser::GetStats(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    Stats& stats = parser->stats;
+    stats.bytes = parser->tokenizer.bytes;
+    stats.splitTokens = parser->tokenizer.splitTokens;
+    stats.bytesCopied = parser->tokenizer.bytesCopied;
+    stats.syntaxErrors = parser->tokenizer.syntaxErrors;
+    UNI_RETURN(scope, args, stats.toObject(isolate));
+  }
+
+  // ndjson mode: the syntax errors skipped since the last call
+  uni::CallbackType Parser::GetErrors(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    UNI_RETURN(scope, args, takeErrors(isolate, parser->tokenizer.errors));
+  }
+
+#ifdef IJSON_TRACE
+  uni::CallbackType Parser::GetTrace(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Parser* parser = ObjectWrap::Unwrap<Parser>(args.This());
+    Isolate* isolate = parser->isolate;
+    if (args.Length() != 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    trace::Trace* trace = &parser->tokenizer.trace;
+    Local<Object> obj = uni::NewObject(isolate);
+
+    // transitions: { state: { class: count } }, zero counts omitted
+    Local<Object> transitions = uni::NewObject(isolate);
+    const trace::Registry* registry = &core::Tokenizer<Parser>::states.registry;
+    for (int i = 0; i < registry->stateCount; i++) {
+      Local<Object> counts = uni::NewObject(isolate);
+      for (int cla = 0; cla <= core::OTHER && cla < TraceMaxClasses; cla++) {
+        if (trace->transitions[i][cla] == 0) continue;
+        const char* name = cla < core::OTHER ? core::Tokenizer<Parser>::classes.names[cla] : "other";
+        setStat(isolate, counts, name, (double)trace->transitions[i][cla]);
+      }
+      transitions->Set(uni::NewSymbol(isolate, registry->states[i].name), counts);
+    }
+    obj->Set(uni::NewSymbol(isolate, "transitions"), transitions);
+
+    Local<Object> time = uni::NewObject(isolate);
+    for (int i = 0; i < trace::CATEGORIES; i++) setStat(isolate, time, trace::categoryName(i), trace->time[i] / 1e6);
+    obj->Set(uni::NewSymbol(isolate, "time"), time);
+
+    Local<Array> latency = uni::NewArray(isolate, TraceLatencyBuckets);
+    for (int i = 0; i < TraceLatencyBuckets; i++) latency->Set(i, uni::NewNumber(isolate, (double)trace->latency[i]));
+    obj->Set(uni::NewSymbol(isolate, "updateLatency"), latency);
+    UNI_RETURN(scope, args, obj);
+  }
+#endif
+
   void Parser::Init(Handle<Object> target) {
     UNI_SCOPE(scope);
 
@@ -848,8 +1684,33 @@ namespace ijson {
     uni::Deref(isolate, constructorTemplate)->InstanceTemplate()->SetInternalFieldCount(1);
     uni::Deref(isolate, constructorTemplate)->SetClassName(uni::NewSymbol(isolate, "Parser"));
     NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "_update", Update);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "updateFile", UpdateFile);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "pause", Pause);
     NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "result", Result);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "stats", GetStats);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "errors", GetErrors);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "reset", Reset);
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "flush", Flush);
+#ifdef IJSON_TRACE
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, constructorTemplate), "trace", GetTrace);
+#endif
     target->Set(uni::NewSymbol(isolate, "Parser"), uni::Deref(isolate, constructorTemplate)->GetFunction());
+    NODE_SET_METHOD(target, "parseMany", ParseMany);
+
+    Local<FunctionTemplate> it = uni::NewFunctionTemplate(isolate, Index::New);
+    uni::Reset(isolate, Index::constructorTemplate, it);
+    uni::Deref(isolate, Index::constructorTemplate)->InstanceTemplate()->SetInternalFieldCount(1);
+    uni::Deref(isolate, Index::constructorTemplate)->SetClassName(uni::NewSymbol(isolate, "Index"));
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, Index::constructorTemplate), "_range", Index::Range);
+    target->Set(uni::NewSymbol(isolate, "Index"), uni::Deref(isolate, Index::constructorTemplate)->GetFunction());
+
+    Local<FunctionTemplate> st = uni::NewFunctionTemplate(isolate, Serializer::New);
+    uni::Reset(isolate, Serializer::constructorTemplate, st);
+    uni::Deref(isolate, Serializer::constructorTemplate)->InstanceTemplate()->SetInternalFieldCount(1);
+    uni::Deref(isolate, Serializer::constructorTemplate)->SetClassName(uni::NewSymbol(isolate, "Serializer"));
+    NODE_SET_PROTOTYPE_METHOD(uni::Deref(isolate, Serializer::constructorTemplate), "next", Serializer::Next);
+    target->Set(uni::NewSymbol(isolate, "Serializer"), uni::Deref(isolate, Serializer::constructorTemplate)->GetFunction());
+    target->Set(uni::NewSymbol(isolate, "simd"), uni::NewString(isolate, simd::kernels().name));
   }
 
   uni::CallbackType Parser::New(const uni::FunctionCallbackInfo & args) {
@@ -857,8 +1718,10 @@ namespace ijson {
     Parser* parser = new Parser();
     Isolate* isolate = parser->isolate;
     parser->Wrap(args.This());
-    // little js wrapper is responsible for passing 2 args
-    if (args.Length() != 2) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    // little js wrapper is responsible for passing 3 args
+    if (args.Length() != 3) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[2]->IsObject()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 3: object expected")));
+    parser->setOptions(isolate, Local<Object>::Cast(args[2]));
     if (!args[0]->IsUndefined()) {
       if (!args[0]->IsFunction()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: function expected"))); 
       uni::Reset(isolate, parser->callback, Local<Function>::Cast(args[0]));
@@ -872,24 +1735,626 @@ namespace ijson {
     UNI_RETURN(scope, args, args.This());
   }
 
-  Parser::Parser() {
+  void Parser::setOptions(Isolate* isolate, Local<Object> options) {
+    this->validateOnly = options->Get(uni::NewSymbol(isolate, "validateOnly"))->BooleanValue();
+    this->typedArrays = options->Get(uni::NewSymbol(isolate, "typedArrays"))->BooleanValue();
+    this->columnar = options->Get(uni::NewSymbol(isolate, "columnar"))->BooleanValue();
+    Local<Value> external = options->Get(uni::NewSymbol(isolate, "externalStrings"));
+    // shorter strings are cheaper to copy (and may hit the cache)
+    if (external->IsNumber()) this->externalMin = external->Int32Value() > 0 ? std::max(external->Int32Value(), CacheEntryMaxSize + 1) : 0;
+    else if (external->BooleanValue()) this->externalMin = 1024;
+    Local<Value> coalesce = options->Get(uni::NewSymbol(isolate, "coalesce"));
+    if (coalesce->IsNumber()) this->coalesce = coalesce->Int32Value() > 0 ? coalesce->Int32Value() : 0;
+    else if (coalesce->BooleanValue()) this->coalesce = 4096;
+    Local<Value> delay = options->Get(uni::NewSymbol(isolate, "coalesceDelay"));
+    if (delay->IsNumber() && delay->NumberValue() > 0) this->coalesceDelay = (uint64_t)(delay->NumberValue() * 1e6);
+    // pauseAfter: update() stops after every pauseAfter values completed at pauseDepth (default 1: the elements of a top-level array)
+    Local<Value> pauseAfter = options->Get(uni::NewSymbol(isolate, "pauseAfter"));
+    Local<Value> pauseDepth = options->Get(uni::NewSymbol(isolate, "pauseDepth"));
+    if (pauseAfter->IsNumber() && pauseAfter->Int32Value() > 0 && !this->validateOnly) {
+      this->tokenizer.pauseEvery(pauseAfter->Int32Value(), pauseDepth->IsNumber() ? pauseDepth->Int32Value() : 1);
+    }
+    // keyOrder: false disables key prediction. An array of keys gives the initial predictions of every depth.
+    Local<Value> keyOrder = options->Get(uni::NewSymbol(isolate, "keyOrder"));
+    this->predictKeys = !(keyOrder->IsBoolean() && !keyOrder->BooleanValue());
+    if (keyOrder->IsArray()) {
+      Local<Array> keys = Local<Array>::Cast(keyOrder);
+      for (uint32_t i = 0; i < keys->Length(); i++) {
+        String::Utf8Value key(keys->Get(i));
+        this->keyOrder.push_back(std::string(*key, key.length()));
+      }
+    }
+    // ndjson: newline separated values, and lines with syntax errors are skipped
+    this->tokenizer.ndjson = options->Get(uni::NewSymbol(isolate, "ndjson"))->BooleanValue();
+    Local<Value> transforms = options->Get(uni::NewSymbol(isolate, "transforms"));
+    if (transforms->IsArray()) this->setTransforms(isolate, Local<Array>::Cast(transforms));
+    // inflate: true for gzip or zlib data (detected from the header), 'raw' for raw deflate data
+    Local<Value> inflate = options->Get(uni::NewSymbol(isolate, "inflate"));
+    int windowBits = 0;
+    if (inflate->IsString() && strcmp(*String::Utf8Value(inflate), "raw") == 0) windowBits = -MAX_WBITS;
+    else if (inflate->BooleanValue()) windowBits = MAX_WBITS + 32;
+    if (windowBits && !this->zstream) {
+      this->zstream = new z_stream();
+      if (inflateInit2(this->zstream, windowBits) != Z_OK) {
+        delete this->zstream;
+        this->zstream = NULL;
+      } else {
+        this->window.resize(InflateWindowSize);
+      }
+    }
+  }
+
+  // JSON pointer token, unescaped
+  TransformToken transformToken(const std::string& name) {
+    TransformToken token;
+    token.any = name == "*";
+    token.index = name.empty() || name.size() > 9 || (name[0] == '0' && name.size() > 1) ? -1 : 0;
+    for (size_t i = 0; i < name.size() && token.index >= 0; i++) {
+      token.index = name[i] >= '0' && name[i] <= '9' ? token.index * 10 + name[i] - '0' : -1;
+    }
+    token.utf8 = name;
+    // the other encodings of the key, as the tokenizer passes them for strings
+    token.oneByte = true;
+    for (size_t i = 0; i < name.size();) {
+      unsigned char c = name[i];
+      int n = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+      uint32_t cp = n == 0 ? c : c & (0x3f >> n);
+      for (int j = 1; j <= n && i + j < name.size(); j++) cp = (cp << 6) | (name[i + j] & 0x3f);
+      i += n + 1;
+      if (cp < 0x100) token.latin1 += (char)cp;
+      else token.oneByte = false;
+      if (cp < 0x10000) {
+        token.utf16.push_back((uint16_t)cp);
+      } else {
+        token.utf16.push_back((uint16_t)(0xd800 + ((cp - 0x10000) >> 10)));
+        token.utf16.push_back((uint16_t)(0xdc00 + ((cp - 0x10000) & 0x3ff)));
+      }
+    }
+    return token;
+  }
+
+  // transforms option: an array of rules { path, date, number, dropNull, rename }.
+  // path is a JSON pointer where * matches any key or index. Rules without a path apply to all values, and cannot rename.
+  void Parser::setTransforms(Isolate* isolate, Local<Array> rules) {
+    Transforms& t = this->transforms;
+    for (uint32_t i = 0; i < rules->Length() && t.rules.size() < MaxTransforms; i++) {
+      if (!rules->Get(i)->IsObject()) continue;
+      Local<Object> options = Local<Object>::Cast(rules->Get(i));
+      Local<Value> path = options->Get(uni::NewSymbol(isolate, "path"));
+      Local<Value> rename = options->Get(uni::NewSymbol(isolate, "rename"));
+      TransformRule rule;
+      rule.global = !path->IsString();
+      if (!rule.global) {
+        std::string pointer(*String::Utf8Value(path));
+        if (!pointer.empty() && pointer[0] != '/') continue;
+        for (size_t pos = 0; pos < pointer.size();) {
+          size_t end = pointer.find('/', pos + 1);
+          if (end == std::string::npos) end = pointer.size();
+          std::string name;
+          for (size_t j = pos + 1; j < end; j++) {
+            if (pointer[j] == '~' && j + 1 < end && (pointer[j + 1] == '0' || pointer[j + 1] == '1')) name += pointer[++j] == '0' ? '~' : '/';
+            else name += pointer[j];
+          }
+          rule.tokens.push_back(transformToken(name));
+          pos = end;
+        }
+      }
+      uint32_t bit = 1u << t.rules.size();
+      if (options->Get(uni::NewSymbol(isolate, "date"))->BooleanValue()) t.dates |= bit;
+      if (options->Get(uni::NewSymbol(isolate, "number"))->BooleanValue()) t.numbers |= bit;
+      if (options->Get(uni::NewSymbol(isolate, "dropNull"))->BooleanValue()) t.dropNulls |= bit;
+      if (rename->IsString() && !rule.global) {
+        t.renames |= bit;
+        uni::Reset(isolate, t.renamed[t.rules.size()], uni::NewValue(isolate, uni::NewSymbol(isolate, *String::Utf8Value(rename))));
+      }
+      size_t n = rule.tokens.size();
+      if (rule.global) {
+        t.global |= bit;
+      } else {
+        if (t.exact.size() <= n) t.exact.resize(n + 1, 0);
+        if (t.deeper.size() < n) t.deeper.resize(n, 0);
+        t.exact[n] |= bit;
+        for (size_t d = 0; d < n; d++) t.deeper[d] |= bit;
+        this->frame->rules |= bit;
+      }
+      t.rules.push_back(rule);
+    }
+  }
+
+  // gets ready for a new document. Frames, caches and options are kept.
+  void Parser::reset() {
+    this->tokenizer.reset();
+    this->pending.clear();
+    this->pendingPaused = false;
+    if (this->zstream) {
+      inflateReset(this->zstream);
+      this->inflated = false;
+      this->windowPos = this->windowLen = 0;
+    }
+    // frames of an unfinished document are reused by the next one
+    for (; this->frame->prev; this->frame = this->frame->prev) {
+      if (!this->frame->value) this->frame->restore(this->isolate);
+    }
+    this->frame->arrayPos = 0;
+    this->utf8 = simd::Utf8Validator();
+    this->columns.clear();
+    this->records = 0;
+    this->column = 0;
+    this->markLine = 0;
+  }
+
+  Parser::Parser() : tokenizer(*this) {
     Isolate* isolate =  Isolate::GetCurrent();
     this->isolate = isolate;
-    this->beg = -1;
-    this->line = 1;
-    this->needsKey = false;
-    this->error = NULL;
-    this->state = BEFORE_VALUE;
     this->frame = new Frame(this, NULL, false);
     this->frame->arrayPos = 0;
     uni::Reset(isolate, this->frame->pvalue, uni::NewValue(isolate, uni::NewArray(isolate, 0)));
     this->callbackDepth = -1;
+    this->validateOnly = false;
+    this->typedArrays = false;
+    this->columnar = false;
+    this->records = 0;
+    this->column = 0;
+    this->markLine = 0;
+    this->externalMin = 0;
+    this->predictKeys = true;
+    this->slab = NULL;
+    this->coalesce = 0;
+    this->coalesceDelay = 0;
+    this->pendingSince = 0;
+    this->pendingPaused = false;
+    this->zstream = NULL;
+    this->inflated = false;
+    this->windowPos = 0;
+    this->windowLen = 0;
+    this->keysCache = new Cache(512, false);
+    this->valuesCache = new Cache(512, false);
+    this->warmKeys = new Cache(256, true);
+    this->keysCache->next = this->warmKeys;
   }
 
   Parser::~Parser() {
-    if (this->error) delete this->error;
-    if (this->frame) delete this->frame;
+    delete this->keysCache;
+    delete this->valuesCache;
+    delete this->warmKeys;
+    if (this->slab) this->slab->release();
+    if (this->zstream) {
+      inflateEnd(this->zstream);
+      delete this->zstream;
+    }
+    // frames are deleted from the root, the parser may be in the middle of a document
+    if (this->frame) {
+      while (this->frame->prev) this->frame = this->frame->prev;
+      delete this->frame;
+    }
     uni::Dispose(this->isolate, this->callback);
+    uni::Dispose(this->isolate, this->flattened);
+    for (int i = 0; i < MaxTransforms; i++) uni::Dispose(this->isolate, this->transforms.renamed[i]);
+  }
+}
+
+namespace ijson {
+  Persistent<FunctionTemplate> Index::constructorTemplate;
+
+  uni::CallbackType Index::New(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Index* index = new Index();
+    Isolate* isolate = Isolate::GetCurrent();
+    index->Wrap(args.This());
+    if (args.Length() != 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[0]->IsObject() || !Buffer::HasInstance(args[0])) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: buffer expected")));
+    Local<Object> buf = Local<Object>::Cast(args[0]);
+    // offsets are 32 bits, and the tokenizer takes an int length
+    if (Buffer::Length(buf) > (size_t)INT_MAX) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: buffer larger than 2 GB")));
+    IndexBuilder builder(index);
+    int len = (int)Buffer::Length(buf);
+    builder.tokenizer.update(Buffer::Data(buf), len, UTF8);
+    if (builder.tokenizer.end() && builder.tokenizer.depth() == 0 && index->entries.size() > 0) {
+      // a number at the end of the buffer is only closed by end()
+      if (index->entries[0].end <= index->entries[0].begin) index->entries[0].end = len;
+      if (index->entries[0].next != index->entries.size()) builder.tokenizer.fail("Too many results");
+    }
+    if (builder.tokenizer.error) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, builder.tokenizer.error->c_str())));
+    UNI_RETURN(scope, args, args.This());
+  }
+
+  // array elements are addressed by their decimal index, without leading zeros
+  inline int arrayIndex(const char* p, int len) {
+    if (len == 0 || len > 9 || (p[0] == '0' && len > 1)) return -1;
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+      if (p[i] < '0' || p[i] > '9') return -1;
+      n = n * 10 + (p[i] - '0');
+    }
+    return n;
+  }
+
+  // returns the entry addressed by the tokens, -1 if there is none
+  int Index::find(Local<Array> tokens) {
+    uint32_t i = 0;
+    for (uint32_t t = 0; t < tokens->Length(); t++) {
+      IndexEntry& entry = this->entries[i];
+      if (entry.next == i + 1) return -1; // scalar or empty container
+      String::Utf8Value token(tokens->Get(t));
+      uint32_t found = 0;
+      if (entry.object) {
+        // last one wins, like with JSON.parse
+        for (uint32_t j = i + 1; j < entry.next; j = this->entries[j].next) {
+          IndexEntry& member = this->entries[j];
+          if ((int)member.keyLen == token.length() && !memcmp(this->keys.data() + member.key, *token, member.keyLen)) found = j;
+        }
+      } else {
+        int n = arrayIndex(*token, token.length());
+        for (uint32_t j = i + 1; n >= 0 && j < entry.next; j = this->entries[j].next, n--) {
+          if (n == 0) found = j;
+        }
+      }
+      if (found == 0) return -1;
+      i = found;
+    }
+    return i;
+  }
+
+  uni::CallbackType Index::Range(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Index* index = ObjectWrap::Unwrap<Index>(args.This());
+    Isolate* isolate = Isolate::GetCurrent();
+    if (args.Length() != 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[0]->IsArray()) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: array expected")));
+    int i = index->find(Local<Array>::Cast(args[0]));
+    if (i < 0) UNI_RETURN(scope, args, uni::Undefined(isolate));
+    Local<Array> range = uni::NewArray(isolate, 2);
+    range->Set(0, uni::NewNumber(isolate, index->entries[i].begin));
+    range->Set(1, uni::NewNumber(isolate, index->entries[i].end));
+    UNI_RETURN(scope, args, range);
+  }
+}
+
+namespace ijson {
+  Persistent<FunctionTemplate> Serializer::constructorTemplate;
+
+  // serializes the next element or property, or closes the current array or object
+  void Serializer::step() {
+    Isolate* isolate = this->isolate;
+    if (!this->started) {
+      this->started = true;
+      Local<Value> root = uni::HandleToLocal(uni::Deref(isolate, this->root));
+      uni::Dispose(isolate, this->root);
+      this->value(root, NULL, uni::NewString(isolate, ""));
+      if (this->depth == 0) this->done = true;
+      return;
+    }
+    SerializerFrame* frame = this->frames[this->depth - 1];
+    if (frame->index == frame->length) {
+      this->write(frame->array ? "]" : "}", 1);
+      uni::Dispose(isolate, frame->pvalue);
+      uni::Dispose(isolate, frame->pnames);
+      if (--this->depth == 0) this->done = true;
+      return;
+    }
+    uint32_t i = frame->index++;
+    if (frame->array) {
+      if (i > 0) this->write(",", 1);
+      this->value(frame->value->Get(i), frame, Local<Value>());
+    } else {
+      Local<Value> name = frame->names->Get(i);
+      this->value(frame->value->Get(name), frame, name);
+    }
+  }
+
+  // writes a value, or pushes a frame for an array or object.
+  // name is the key in the parent object, empty in arrays.
+  void Serializer::value(Local<Value> val, SerializerFrame* parent, Local<Value> name) {
+    Isolate* isolate = this->isolate;
+    // toJSON (dates, buffers, user classes, arrays too)
+    if (val->IsObject()) {
+      Local<Value> fn = Local<Object>::Cast(val)->Get(this->toJSON);
+      if (fn->IsFunction()) {
+        Handle<Value> argv[1];
+        if (!name.IsEmpty()) {
+          argv[0] = name;
+        } else {
+          char index[16];
+          snprintf(index, sizeof index, "%u", parent ? parent->index - 1 : 0);
+          argv[0] = uni::NewString(isolate, index);
+        }
+        val = Local<Function>::Cast(fn)->Call(val, 1, argv);
+        if (val.IsEmpty()) {
+          this->aborted = true;
+          return;
+        }
+      }
+    }
+    // boxed primitives are written as their primitive value
+    if (val->IsNumberObject()) val = uni::NewNumber(isolate, val->NumberValue());
+    else if (val->IsStringObject()) val = val->ToString();
+    else if (val->IsBooleanObject()) val = uni::BooleanObjectValue(val) ? uni::True(isolate) : uni::False(isolate);
+    int typedLength = -1;
+    bool skip = !(val->IsString() || val->IsNumber() || val->IsBoolean() || val->IsNull() || val->IsObject()) || val->IsFunction();
+    if (skip) {
+      // like JSON.stringify: null in arrays, property skipped in objects
+      if (parent && parent->array) this->write("null", 4);
+      return;
+    }
+    if (parent && !parent->array) this->key(parent, name);
+    if (val->IsString()) this->string(Local<String>::Cast(val));
+    else if (val->IsNumber()) this->number(val->NumberValue());
+    else if (val->IsBoolean()) val->BooleanValue() ? this->write("true", 4) : this->write("false", 5);
+    else if (val->IsNull()) this->write("null", 4);
+    else if (val->IsArray()) this->push(Local<Object>::Cast(val), true, Local<Array>::Cast(val)->Length());
+    // typed arrays (see the typedArrays parser option) are written as arrays of numbers
+    else if ((typedLength = uni::TypedArrayLength(val)) >= 0) this->push(Local<Object>::Cast(val), true, typedLength);
+    else this->push(Local<Object>::Cast(val), false, 0);
+  }
+
+  void Serializer::key(SerializerFrame* frame, Local<Value> name) {
+    Isolate* isolate = this->isolate;
+    if (!frame->empty) this->write(",", 1);
+    frame->empty = false;
+    int i = (int)frame->index - 1;
+    if (i >= MaxPredictedKeys) {
+      this->string(name->ToString());
+      this->write(":", 1);
+      return;
+    }
+    if (!frame->keys) frame->keys = new SerializedKey[MaxPredictedKeys];
+    SerializedKey& k = frame->keys[i];
+    if (!k.pkey.IsEmpty() && uni::Deref(isolate, k.pkey) == name) {
+      this->write(k.bytes.data(), k.bytes.size());
+      return;
+    }
+    size_t start = this->out.size();
+    this->string(name->ToString());
+    this->write(":", 1);
+    uni::Reset(isolate, k.pkey, name);
+    k.bytes.assign(&this->out[start], this->out.size() - start);
+  }
+
+  void Serializer::push(Local<Object> obj, bool array, uint32_t length) {
+    Isolate* isolate = this->isolate;
+    for (int i = 0; i < this->depth; i++) {
+      if (this->frames[i]->value->StrictEquals(obj)) {
+        this->error = "Converting circular structure to JSON";
+        return;
+      }
+    }
+    if (this->depth == (int)this->frames.size()) this->frames.push_back(new SerializerFrame());
+    SerializerFrame* frame = this->frames[this->depth++];
+    frame->value = obj;
+    uni::Reset(isolate, frame->pvalue, obj);
+    if (!array) {
+      frame->names = obj->GetOwnPropertyNames();
+      uni::Reset(isolate, frame->pnames, frame->names);
+      length = frame->names->Length();
+    }
+    frame->index = 0;
+    frame->length = length;
+    frame->array = array;
+    frame->empty = true;
+    this->write(array ? "[" : "{", 1);
+  }
+
+  // the UTF-8 bytes are written in place. They only need a second pass in the rare case where they contain
+  // chars to escape, which are found with the SIMD kernel.
+  // Two-byte strings are converted by utf16() because V8 would replace their lone surrogates with U+FFFD.
+  void Serializer::string(Local<String> str) {
+    if (!uni::IsOneByte(str)) {
+      int length = str->Length();
+      if (this->wscratch.size() < (size_t)length + 1) this->wscratch.resize(length + 1);
+      uni::WriteTwoByte(str, &this->wscratch[0], length);
+      this->write("\"", 1);
+      this->utf16(&this->wscratch[0], length);
+      this->write("\"", 1);
+      return;
+    }
+    size_t len = (size_t)str->Utf8Length();
+    size_t start = this->out.size();
+    this->out.resize(start + 1 + len);
+    this->out[start] = '"';
+    char* p = &this->out[start + 1];
+    str->WriteUtf8(p, (int)len, NULL, String::NO_NULL_TERMINATION);
+    size_t n = (size_t)simd::kernels().scanEscape(p, (int)len);
+    if (n < len) {
+      this->scratch.assign(p + n, p + len);
+      this->out.resize(start + 1 + n);
+      this->escape(&this->scratch[0], len - n);
+    }
+    this->write("\"", 1);
+  }
+
+  void Serializer::escape(const char* p, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    while (len > 0) {
+      size_t n = (size_t)simd::kernels().scanEscape(p, (int)len);
+      this->write(p, n);
+      if (n == len) return;
+      char ch = p[n];
+      char esc[6] = { '\\', ch, 0, 0, 0, 0 };
+      size_t escLen = 2;
+      switch (ch) {
+      case '"': case '\\': break;
+      case '\b': esc[1] = 'b'; break;
+      case '\f': esc[1] = 'f'; break;
+      case '\n': esc[1] = 'n'; break;
+      case '\r': esc[1] = 'r'; break;
+      case '\t': esc[1] = 't'; break;
+      default:
+        esc[1] = 'u';
+        esc[2] = '0';
+        esc[3] = '0';
+        esc[4] = hex[(ch >> 4) & 0xf];
+        esc[5] = hex[ch & 0xf];
+        escLen = 6;
+      }
+      this->write(esc, escLen);
+      p += n + 1;
+      len -= n + 1;
+    }
+  }
+
+  // UTF-16 to UTF-8, with the escapes of JSON.stringify: lone surrogates are written as \udxxx escapes.
+  void Serializer::utf16(const uint16_t* p, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[6];
+    for (size_t i = 0; i < len; i++) {
+      uint32_t c = p[i];
+      if (c < 0x80) {
+        buf[0] = (char)c;
+        if (c < 0x20 || c == '"' || c == '\\') this->escape(buf, 1);
+        else this->out.push_back(buf[0]);
+      } else if (c < 0x800) {
+        buf[0] = (char)(0xc0 | (c >> 6));
+        buf[1] = (char)(0x80 | (c & 0x3f));
+        this->write(buf, 2);
+      } else if (c >= 0xd800 && c < 0xdc00 && i + 1 < len && p[i + 1] >= 0xdc00 && p[i + 1] < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (p[++i] - 0xdc00);
+        buf[0] = (char)(0xf0 | (c >> 18));
+        buf[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+        buf[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+        buf[3] = (char)(0x80 | (c & 0x3f));
+        this->write(buf, 4);
+      } else if (c >= 0xd800 && c < 0xe000) {
+        buf[0] = '\\';
+        buf[1] = 'u';
+        buf[2] = hex[c >> 12];
+        buf[3] = hex[(c >> 8) & 0xf];
+        buf[4] = hex[(c >> 4) & 0xf];
+        buf[5] = hex[c & 0xf];
+        this->write(buf, 6);
+      } else {
+        buf[0] = (char)(0xe0 | (c >> 12));
+        buf[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        buf[2] = (char)(0x80 | (c & 0x3f));
+        this->write(buf, 3);
+      }
+    }
+  }
+
+  // integers are converted directly. Other numbers get the shortest precision which reads back the same double,
+  // and are formatted like Number.prototype.toString (so like JSON.stringify): 1e-7, 1e+21, 0.000001, 123.456.
+  void Serializer::number(double val) {
+    char buf[32];
+    int len = 0;
+    if (!isfinite(val)) {
+      this->write("null", 4);
+      return;
+    }
+    if (val == floor(val) && fabs(val) < 1e15) {
+      // -0 is written as 0, like JSON.stringify
+      int64_t n = (int64_t)val;
+      uint64_t u = n < 0 ? (uint64_t)-n : (uint64_t)n;
+      char* end = buf + sizeof buf;
+      char* p = end;
+      do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+      } while (u);
+      if (n < 0) *--p = '-';
+      this->write(p, end - p);
+      return;
+    }
+    // d.ddde[+-]x with 15 to 17 significant digits. Any shorter representation of a normal double also reads
+    // back with 15 digits and then ends with zeros, subnormals have less precision and are searched from 1 digit.
+    for (int precision = fabs(val) < DBL_MIN ? 1 : 15; precision <= 17; precision++) {
+      len = snprintf(buf, sizeof buf, "%.*e", precision - 1, val);
+      if (strtod(buf, NULL) == val) break;
+    }
+    char* p = buf;
+    if (*p == '-') this->write(p++, 1);
+    char* e = strchr(p, 'e');
+    int exp = atoi(e + 1);
+    // digits without the dot and the trailing zeros: value is 0.digits * 10^n
+    char digits[20];
+    int k = 0;
+    for (char* q = p; q < e; q++) if (*q != '.') digits[k++] = *q;
+    while (k > 1 && digits[k - 1] == '0') k--;
+    int n = exp + 1;
+    if (k <= n && n <= 21) {
+      this->write(digits, k);
+      for (int i = k; i < n; i++) this->write("0", 1);
+    } else if (0 < n && n <= 21) {
+      this->write(digits, n);
+      this->write(".", 1);
+      this->write(digits + n, k - n);
+    } else if (-6 < n && n <= 0) {
+      this->write("0.", 2);
+      for (int i = n; i < 0; i++) this->write("0", 1);
+      this->write(digits, k);
+    } else {
+      this->write(digits, 1);
+      if (k > 1) {
+        this->write(".", 1);
+        this->write(digits + 1, k - 1);
+      }
+      len = snprintf(buf, sizeof buf, "e%c%d", n - 1 < 0 ? '-' : '+', abs(n - 1));
+      this->write(buf, len);
+    }
+  }
+
+  uni::CallbackType Serializer::New(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Serializer* serializer = new Serializer();
+    Isolate* isolate = serializer->isolate;
+    serializer->Wrap(args.This());
+    if (args.Length() != 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    uni::Reset(isolate, serializer->root, uni::NewValue(isolate, args[0]));
+    UNI_RETURN(scope, args, args.This());
+  }
+
+  // returns a buffer with the next maxBytes bytes (or less at the end), null when the value has been serialized.
+  // A buffer is filled by steps: bytes written past maxBytes by the last step are returned by the next call.
+  uni::CallbackType Serializer::Next(const uni::FunctionCallbackInfo& args) {
+    UNI_SCOPE(scope);
+    Serializer* serializer = ObjectWrap::Unwrap<Serializer>(args.This());
+    Isolate* isolate = serializer->isolate;
+    if (args.Length() != 1) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg count")));
+    if (!args[0]->IsNumber() || args[0]->Int32Value() <= 0) UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, "bad arg 1: positive integer expected")));
+    size_t maxBytes = (size_t)args[0]->Int32Value();
+
+    for (int i = 0; i < serializer->depth; i++) {
+      SerializerFrame* frame = serializer->frames[i];
+      frame->value = uni::HandleToLocal(uni::Deref(isolate, frame->pvalue));
+      if (!frame->array) frame->names = uni::HandleToLocal(uni::Deref(isolate, frame->pnames));
+    }
+    serializer->toJSON = uni::NewSymbol(isolate, "toJSON");
+    while (!serializer->done && serializer->out.size() - serializer->outPos < maxBytes) {
+      serializer->step();
+      if (serializer->aborted || !serializer->error.empty()) {
+        serializer->done = true;
+        serializer->out.clear();
+        serializer->outPos = 0;
+        if (serializer->aborted) UNI_RETURN(scope, args, uni::Undefined(isolate)); // toJSON exception is pending
+        UNI_THROW(isolate, Exception::Error(uni::NewString(isolate, serializer->error.c_str())));
+      }
+    }
+
+    size_t len = std::min(maxBytes, serializer->out.size() - serializer->outPos);
+    if (len == 0) UNI_RETURN(scope, args, uni::Null(isolate));
+    Handle<Value> buf = uni::NewBuffer(isolate, &serializer->out[serializer->outPos], len);
+    serializer->outPos += len;
+    // the output buffer is reused: the bytes which are left are moved to its front
+    if (serializer->outPos == serializer->out.size()) {
+      serializer->out.clear();
+      serializer->outPos = 0;
+    } else if (serializer->outPos >= serializer->out.size() / 2) {
+      serializer->out.erase(serializer->out.begin(), serializer->out.begin() + serializer->outPos);
+      serializer->outPos = 0;
+    }
+    UNI_RETURN(scope, args, buf);
+  }
+
+  Serializer::Serializer() {
+    this->isolate = Isolate::GetCurrent();
+    this->depth = 0;
+    this->started = false;
+    this->done = false;
+    this->aborted = false;
+    this->outPos = 0;
+  }
+
+  Serializer::~Serializer() {
+    uni::Dispose(this->isolate, this->root);
+    for (size_t i = 0; i < this->frames.size(); i++) delete this->frames[i];
   }
 }
 
@@ -0,0 +1,340 @@
+/**
+ * Copyright (c) 2014 Bruno Jouhier <bjouhier@gmail.com>
+ * MIT License
+ */
+// Vectorized kernels with runtime CPU dispatch.
+// The SSE4.2 and AVX2 variants are compiled with target attributes rather than global -m flags
+// so a single binary runs everywhere; the best variant is selected when the addon is loaded.
+
+#ifndef IJSON_SIMD_H
+#define IJSON_SIMD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define IJSON_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace ijson {
+namespace simd {
+  // validates UTF-8 in whole blocks from the start of a sequence.
+  // returns the length of the valid prefix, which ends on a sequence boundary, or -1 if p is malformed.
+  // the remaining bytes (less than a block plus an incomplete sequence) are left to the scalar validator.
+  typedef int (*utf8Fn)(const char* p, int len);
+
+  // returns the offset of the first '"', '\\' or control char (< 0x20) in p[0..len[, or len if there is none.
+  // These are the chars which end a run of raw string chars, when parsing and when serializing.
+  typedef int (*escapeFn)(const char* p, int len);
+
+  typedef struct Kernels {
+    const char* name;
+    utf8Fn utf8Prefix;
+    escapeFn scanEscape;
+  } Kernels;
+
+  inline int scanEscapeScalar(const char* p, int len) {
+    int i = 0;
+    while (i < len) {
+      unsigned char ch = (unsigned char)p[i];
+      if (ch == '"' || ch == '\\' || ch < 0x20) break;
+      i++;
+    }
+    return i;
+  }
+
+  inline int utf8PrefixScalar(const char* p, int len) {
+    return 0;
+  }
+
+  // true if p[0..len[ is 7-bit ASCII. A word at a time is enough, the caller is about to reference the bytes anyway.
+  inline bool isAscii(const char* p, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+      uint64_t w;
+      memcpy(&w, p + i, 8);
+      if (w & 0x8080808080808080ULL) return false;
+    }
+    for (; i < len; i++) if (p[i] & 0x80) return false;
+    return true;
+  }
+
+  // backs up over an incomplete sequence at the end of p[0..len[
+  inline int utf8Boundary(const char* p, int len) {
+    for (int k = 1; k <= 3 && k <= len; k++) {
+      unsigned char ch = p[len - k];
+      if (ch < 0x80) break;
+      if (ch >= 0xc0) {
+        int n = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : 2;
+        if (n > k) return len - k;
+        break;
+      }
+    }
+    return len;
+  }
+
+#ifdef IJSON_X86_DISPATCH
+  // Lookup tables of the algorithm by Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+  // Each byte is classified by its high nibble, the high and low nibbles of the previous byte,
+  // and the error flags of the three lookups are and-ed together.
+#define U8_TOO_SHORT (1 << 0)
+#define U8_TOO_LONG (1 << 1)
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE (1 << 3)
+#define U8_SURROGATE (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS (1 << 7)
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+  const signed char utf8Byte1High[16] = {
+    // 0xxx: ASCII
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    // 10xx: continuation
+    (signed char)U8_TWO_CONTS, (signed char)U8_TWO_CONTS, (signed char)U8_TWO_CONTS, (signed char)U8_TWO_CONTS,
+    // 1100, 1101: two byte lead
+    U8_TOO_SHORT | U8_OVERLONG_2,
+    U8_TOO_SHORT,
+    // 1110: three byte lead
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+    // 1111: four byte lead
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+  };
+
+  const signed char utf8Byte1Low[16] = {
+    (signed char)(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4),
+    (signed char)(U8_CARRY | U8_OVERLONG_2),
+    (signed char)U8_CARRY,
+    (signed char)U8_CARRY,
+    (signed char)(U8_CARRY | U8_TOO_LARGE),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+    (signed char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000)
+  };
+
+  const signed char utf8Byte2High[16] = {
+    // 0xxx: ASCII
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    // 1000
+    (signed char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+    // 1001
+    (signed char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE),
+    // 101x
+    (signed char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+    (signed char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+    // 11xx: lead
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+  };
+
+  __attribute__((target("sse4.2")))
+  inline __m128i utf8ErrorsSSE42(__m128i input, __m128i prev) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+    __m128i byte1High = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8Byte1High),
+      _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte1Low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8Byte1Low), _mm_and_si128(prev1, nibble));
+    __m128i byte2High = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8Byte2High),
+      _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+    // third and fourth bytes of a sequence must be continuations, which the lookups do not check
+    __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80))),
+      _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80))));
+    __m128i must23x80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23x80, special);
+  }
+
+  __attribute__((target("sse4.2")))
+  inline int utf8PrefixSSE42(const char* p, int len) {
+    __m128i prev = _mm_setzero_si128();
+    __m128i errors = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+      __m128i input = _mm_loadu_si128((const __m128i*)(p + i));
+      errors = _mm_or_si128(errors, utf8ErrorsSSE42(input, prev));
+      prev = input;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) != 0xffff) return -1;
+    return utf8Boundary(p, i);
+  }
+
+  __attribute__((target("avx2")))
+  inline __m256i utf8ErrorsAVX2(__m256i input, __m256i prev) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i byte1High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte1High)),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte1Low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte1Low)),
+      _mm256_and_si256(prev1, nibble));
+    __m256i byte2High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte2High)),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+    __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80))),
+      _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80))));
+    __m256i must23x80 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23x80, special);
+  }
+
+  __attribute__((target("avx2")))
+  inline int utf8PrefixAVX2(const char* p, int len) {
+    // sequences which are still open at the end of a block must be completed by the next one
+    const __m256i maxComplete = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+    __m256i errors = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+      __m256i input = _mm256_loadu_si256((const __m256i*)(p + i));
+      if (_mm256_movemask_epi8(input) == 0) {
+        // ASCII block: only check that the previous block did not end in the middle of a sequence
+        errors = _mm256_or_si256(errors, prevIncomplete);
+      } else {
+        errors = _mm256_or_si256(errors, utf8ErrorsAVX2(input, prev));
+        prevIncomplete = _mm256_subs_epu8(input, maxComplete);
+      }
+      prev = input;
+    }
+    if (!_mm256_testz_si256(errors, errors)) return -1;
+    return utf8Boundary(p, i);
+  }
+
+  // control chars are the bytes which are unchanged by an unsigned max with 0x1f
+  __attribute__((target("sse4.2")))
+  inline int scanEscapeSSE42(const char* p, int len) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+      __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, bslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, ctrl), ctrl));
+      unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+      if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scanEscapeScalar(p + i, len - i);
+  }
+
+  __attribute__((target("avx2")))
+  inline int scanEscapeAVX2(const char* p, int len) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+      __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+      __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, bslash)),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, ctrl), ctrl));
+      unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+      if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scanEscapeSSE42(p + i, len - i);
+  }
+#endif
+
+  inline Kernels selectKernels() {
+    Kernels k;
+    k.name = "scalar";
+    k.utf8Prefix = utf8PrefixScalar;
+    k.scanEscape = scanEscapeScalar;
+#ifdef IJSON_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      k.name = "avx2";
+      k.utf8Prefix = utf8PrefixAVX2;
+      k.scanEscape = scanEscapeAVX2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+      k.name = "sse4.2";
+      k.utf8Prefix = utf8PrefixSSE42;
+      k.scanEscape = scanEscapeSSE42;
+    }
+#endif
+    return k;
+  }
+
+  // selected once, on first use
+  inline const Kernels& kernels() {
+    static Kernels k = selectKernels();
+    return k;
+  }
+
+  // Incremental UTF-8 validator: the vectorized kernel validates the bulk of each chunk,
+  // a scalar state machine handles the edges and carries incomplete sequences across chunks.
+  class Utf8Validator {
+  public:
+    Utf8Validator() {
+      this->needs = 0;
+      this->lo = 0x80;
+      this->hi = 0xbf;
+    }
+    int needs; // number of continuation bytes still expected
+    unsigned char lo; // range of the next continuation byte
+    unsigned char hi;
+
+    bool update(const char* p, int len) {
+      int i = 0;
+      while (i < len) {
+        if (this->needs == 0) {
+          int n = kernels().utf8Prefix(p + i, len - i);
+          if (n < 0) return false;
+          i += n;
+          // ASCII fast path, 8 bytes at a time
+          while (i + 8 <= len) {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            if (v & 0x8080808080808080ULL) break;
+            i += 8;
+          }
+          if (i == len) break;
+        }
+        if (!this->step((unsigned char)p[i])) return false;
+        i++;
+      }
+      return true;
+    }
+
+    bool step(unsigned char ch) {
+      if (this->needs > 0) {
+        if (ch < this->lo || ch > this->hi) return false;
+        this->lo = 0x80;
+        this->hi = 0xbf;
+        this->needs--;
+        return true;
+      }
+      if (ch < 0x80) return true;
+      if (ch < 0xc2) return false;
+      if (ch < 0xe0) this->needs = 1;
+      else if (ch < 0xf0) {
+        this->needs = 2;
+        if (ch == 0xe0) this->lo = 0xa0; // overlong
+        else if (ch == 0xed) this->hi = 0x9f; // surrogates
+      } else if (ch < 0xf5) {
+        this->needs = 3;
+        if (ch == 0xf0) this->lo = 0x90; // overlong
+        else if (ch == 0xf4) this->hi = 0x8f; // > U+10FFFF
+      } else return false;
+      return true;
+    }
+
+    bool complete() {
+      return this->needs == 0;
+    }
+  };
+}
+}
+#endif
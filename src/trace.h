@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2014 Bruno Jouhier <bjouhier@gmail.com>
+ * MIT License
+ */
+// Optional instrumentation of the hot path.
+// Tracing is compiled in with `node-gyp rebuild --ijson_trace=1` and exposed by `parser.trace()`.
+// USDT probes are compiled in with `node-gyp rebuild --ijson_usdt=1` (needs <sys/sdt.h>).
+// When both are off, all the macros below expand to nothing.
+
+#ifndef IJSON_TRACE_H
+#define IJSON_TRACE_H
+
+#ifdef IJSON_USDT
+#include <sys/sdt.h>
+#define IJSON_PROBE(name) DTRACE_PROBE(ijson, name)
+#define IJSON_PROBE1(name, a) DTRACE_PROBE1(ijson, name, a)
+#define IJSON_PROBE2(name, a, b) DTRACE_PROBE2(ijson, name, a, b)
+#else
+#define IJSON_PROBE(name)
+#define IJSON_PROBE1(name, a)
+#define IJSON_PROBE2(name, a, b)
+#endif
+
+#ifdef IJSON_TRACE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+namespace ijson {
+namespace trace {
+#define TraceMaxStates 32
+#define TraceMaxClasses 32
+#define TraceLatencyBuckets 24
+
+  enum Category { STRUCTURAL, STRING, NUMBER, CATEGORIES };
+
+  inline const char* categoryName(int category) {
+    static const char* names[CATEGORIES] = { "structural", "string", "number" };
+    return names[category];
+  }
+
+  // monotonic clock in nanoseconds. This header does not depend on node so it cannot use uv_hrtime.
+  inline uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  typedef struct StateInfo {
+    const void* state;
+    const char* name;
+    Category category;
+  } StateInfo;
+
+  // states of one tokenizer type. Each Tokenizer<Handler> instantiation has its own registry
+  // (a static member of its state tables) so the header can be included by several translation units.
+  class Registry {
+  public:
+    StateInfo states[TraceMaxStates];
+    int stateCount;
+
+    Registry() {
+      memset(this, 0, sizeof(*this));
+    }
+
+    void registerState(const void* state, const char* name, Category category) {
+      if (stateCount == TraceMaxStates) {
+        fprintf(stderr, "ijson: more than %d states, increase TraceMaxStates\n", TraceMaxStates);
+        abort();
+      }
+      states[stateCount].state = state;
+      states[stateCount].name = name;
+      states[stateCount].category = category;
+      stateCount++;
+    }
+
+    // linear search is fine: there are only a couple dozen states and this is diagnostic code.
+    inline int stateIndex(const void* state) const {
+      for (int i = 0; i < stateCount; i++) if (states[i].state == state) return i;
+      return 0;
+    }
+  };
+
+  class Trace {
+  public:
+    Trace() {
+      memset(this, 0, sizeof(*this));
+    }
+    uint64_t transitions[TraceMaxStates][TraceMaxClasses];
+    uint64_t time[CATEGORIES]; // nanoseconds
+    uint64_t latency[TraceLatencyBuckets]; // update() latency, bucket i counts calls in [2^(i-1), 2^i[ microseconds
+    const Registry* registry;
+    int category;
+    uint64_t since;
+
+    void start(const Registry* registry, const void* state) {
+      this->registry = registry;
+      this->category = registry->states[registry->stateIndex(state)].category;
+      this->since = now();
+    }
+
+    inline void enter(const void* state, int cla) {
+      int i = this->registry->stateIndex(state);
+      this->transitions[i][cla]++;
+      int category = this->registry->states[i].category;
+      if (category != this->category) {
+        uint64_t t = now();
+        this->time[this->category] += t - this->since;
+        this->since = t;
+        this->category = category;
+      }
+    }
+
+    void stop() {
+      this->time[this->category] += now() - this->since;
+    }
+
+    void update(uint64_t elapsed) {
+      uint64_t us = elapsed / 1000;
+      int bucket = 0;
+      while (us && bucket < TraceLatencyBuckets - 1) {
+        us >>= 1;
+        bucket++;
+      }
+      this->latency[bucket]++;
+    }
+  };
+}
+}
+// used in the tokenizer: `registry` is the trace::Registry of its tokenizer type, `names` the class names of its Classes
+#define TRACE_STATE(registry, state, category) (registry).registerState(state, #state, trace::category)
+#define TRACE_CLASS(names, cla, name) ((names)[cla] = (name))
+#define TRACE_START(parser, registry) (parser)->trace.start(&(registry), (parser)->state)
+#define TRACE_ENTER(parser, cla) (parser)->trace.enter((parser)->state, cla)
+#define TRACE_STOP(parser) (parser)->trace.stop()
+#else
+#define TRACE_STATE(registry, state, category)
+#define TRACE_CLASS(names, cla, name)
+#define TRACE_START(parser, registry)
+#define TRACE_ENTER(parser, cla)
+#define TRACE_STOP(parser)
+#endif
+#endif
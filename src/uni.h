@@ -17,6 +17,39 @@ namespace uni {
   inline Local<String> NewSymbol(Isolate* isolate, const char* str, int len = -1) {
     return String::NewFromUtf8(isolate, str, String::kNormalString, len);
   }
+  inline Local<String> NewOneByteString(Isolate* isolate, const uint8_t* str, int len) {
+    return String::NewFromOneByte(isolate, str, String::kNormalString, len);
+  }
+  inline Local<String> NewTwoByteString(Isolate* isolate, const uint16_t* str, int len) {
+    return String::NewFromTwoByte(isolate, str, String::kNormalString, len);
+  }
+  inline bool IsOneByte(Local<String> str) {
+    return str->IsOneByte();
+  }
+  // returns the characters of an external one-byte string, NULL if the string is not external
+  inline const char* ExternalOneByteData(Local<String> str) {
+#if NODE_MODULE_VERSION >= 42
+    if (!str->IsExternalOneByte()) return NULL;
+    return str->GetExternalOneByteStringResource()->data();
+#else
+    if (!str->IsExternalAscii()) return NULL;
+    return str->GetExternalAsciiStringResource()->data();
+#endif
+  }
+#if NODE_MODULE_VERSION >= 42
+  typedef String::ExternalOneByteStringResource ExternalOneByteResource;
+#else
+  typedef String::ExternalAsciiStringResource ExternalOneByteResource;
+#endif
+  inline Local<String> NewExternalOneByteString(Isolate* isolate, ExternalOneByteResource* res) {
+    return String::NewExternal(isolate, res);
+  }
+  inline void WriteOneByte(Local<String> str, uint8_t* buf, int len) {
+    str->WriteOneByte(buf, 0, len, String::NO_NULL_TERMINATION);
+  }
+  inline void WriteTwoByte(Local<String> str, uint16_t* buf, int len) {
+    str->Write(buf, 0, len, String::NO_NULL_TERMINATION);
+  }
   inline Local<Array> NewArray(Isolate* isolate, int len) {
     return Array::New(isolate, len);
   }
@@ -29,6 +62,17 @@ namespace uni {
   inline Local<Object> NewObject(Isolate* isolate) {
     return Object::New(isolate);
   }
+  // Int32Array if ints is set, Float64Array otherwise
+  inline Local<Value> NewTypedArray(Isolate* isolate, const double* data, size_t len, bool ints) {
+    Local<ArrayBuffer> buf = ArrayBuffer::New(isolate, len * (ints ? sizeof(int32_t) : sizeof(double)));
+    if (ints) {
+      int32_t* p = (int32_t*)buf->GetContents().Data();
+      for (size_t i = 0; i < len; i++) p[i] = (int32_t)data[i];
+      return Int32Array::New(buf, 0, len);
+    }
+    memcpy(buf->GetContents().Data(), data, len * sizeof(double));
+    return Float64Array::New(buf, 0, len);
+  }
   inline Local<Value> NewValue(Isolate* isolate, Handle<Value> val) {
     return Local<Value>::New(isolate, val);
   }
@@ -41,6 +85,9 @@ namespace uni {
   inline Handle<Boolean> False(Isolate* isolate) {
     return v8::False(isolate);
   }
+  inline bool BooleanObjectValue(Local<Value> val) {
+    return Local<BooleanObject>::Cast(val)->ValueOf();
+  }
   inline Handle<Primitive> Null(Isolate* isolate) {
     return v8::Null(isolate);
   }
@@ -76,9 +123,21 @@ namespace uni {
   inline Handle<Value> BufferToHandle(BufferType buf) {
     return buf;
   }
+  // copies data into a new buffer
+  inline Handle<Value> NewBuffer(Isolate* isolate, const char* data, size_t len) {
+    return BufferToHandle(node::Buffer::New(isolate, data, len));
+  }
+  // number of elements of a typed array, -1 if val is not a typed array
+  inline int TypedArrayLength(Local<Value> val) {
+    if (!val->IsTypedArray()) return -1;
+    return (int)Local<TypedArray>::Cast(val)->Length();
+  }
   inline Local<Date> DateCast(Local<Value> date) {
     return Local<Date>::Cast(date);
   }
+  inline Local<Value> NewDate(Isolate* isolate, double ms) {
+    return Date::New(isolate, ms);
+  }
 #else
   typedef Handle<Value> CallbackType;
   typedef Arguments FunctionCallbackInfo;
@@ -100,6 +159,28 @@ namespace uni {
   inline Local<String> NewSymbol(Isolate* isolate, const char* str, int len = -1) {
     return String::NewSymbol(str, len);
   }
+  // old V8 cannot tell one-byte strings apart, so strings always take the two-byte path.
+  inline Local<String> NewOneByteString(Isolate* isolate, const uint8_t* str, int len) {
+    return String::New((const char*)str, len);
+  }
+  inline Local<String> NewTwoByteString(Isolate* isolate, const uint16_t* str, int len) {
+    return String::New(str, len);
+  }
+  inline bool IsOneByte(Local<String> str) {
+    return false;
+  }
+  typedef String::ExternalAsciiStringResource ExternalOneByteResource;
+  inline Local<String> NewExternalOneByteString(Isolate* isolate, ExternalOneByteResource* res) {
+    return String::NewExternal(res);
+  }
+  inline const char* ExternalOneByteData(Local<String> str) {
+    return NULL;
+  }
+  inline void WriteOneByte(Local<String> str, uint8_t* buf, int len) {
+  }
+  inline void WriteTwoByte(Local<String> str, uint16_t* buf, int len) {
+    str->Write(buf, 0, len, String::NO_NULL_TERMINATION);
+  }
   inline Local<Array> NewArray(Isolate* isolate, int len) {
     return Array::New(len);
   }
@@ -112,6 +193,12 @@ namespace uni {
   inline Local<Object> NewObject(Isolate* isolate) {
     return Object::New();
   }
+  // old V8 has no typed array API, so we fall back to a plain array.
+  inline Local<Value> NewTypedArray(Isolate* isolate, const double* data, size_t len, bool ints) {
+    Local<Array> arr = Array::New(len);
+    for (size_t i = 0; i < len; i++) arr->Set(i, Number::New(data[i]));
+    return arr;
+  }
   inline Local<Value> NewValue(Isolate* isolate, Handle<Value> val) {
     return Local<Value>::New(val);
   }
@@ -124,6 +211,9 @@ namespace uni {
   inline Handle<Boolean> False(Isolate* isolate) {
     return v8::False();
   }
+  inline bool BooleanObjectValue(Local<Value> val) {
+    return Local<BooleanObject>::Cast(val)->BooleanValue();
+  }
   inline Handle<Primitive> Null(Isolate* isolate) {
     return v8::Null();
   }
@@ -151,8 +241,18 @@ namespace uni {
   inline Handle<Value> BufferToHandle(BufferType buf) {
     return buf->handle_;
   }
+  inline Handle<Value> NewBuffer(Isolate* isolate, const char* data, size_t len) {
+    return BufferToHandle(node::Buffer::New((char*)data, len));
+  }
+  // old V8 has no typed array API
+  inline int TypedArrayLength(Local<Value> val) {
+    return -1;
+  }
   inline Local<Date> DateCast(Local<Value> date) {
     return Date::Cast(*date);
   }
+  inline Local<Value> NewDate(Isolate* isolate, double ms) {
+    return Date::New(ms);
+  }
 #endif
 }
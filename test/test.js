@@ -1,6 +1,9 @@
 var ijson = require('..');
 const { strictEqual, deepEqual } = require('chai').assert;
 
+// some counters are always 0 with the JS implementation
+var native = typeof ijson.createParser()._update === 'function';
+
 describe('i-json parser', function() {
     function testPass(prefix, parseOk) {
         function parseError(str) {
@@ -41,6 +44,7 @@ describe('i-json parser', function() {
 
         it(prefix + 'complex values', function() {
             testDeep('{"a":{"b":{"c":1,"d":2},"e":[3,4],"f":[true,false,null]}}');
+            testDeep('[{}, "a", [], "b", {"c":{}}, "d"]');
         });
 
         it(prefix + 'extra spaces', function() {
@@ -214,4 +218,385 @@ describe('i-json parser', function() {
         strictEqual(results[7], ': {}');
         strictEqual(JSON.stringify(parser.result()), undefined);
     });
+
+    it('string input', function() {
+        function parse(chunks) {
+            var parser = ijson.createParser();
+            chunks.forEach(function(chunk) {
+                parser.update(chunk);
+            });
+            return parser.result();
+        }
+        deepEqual(parse(['{"caf\u00e9": "cr\u00e8me br\u00fb', 'l\u00e9e", "n": 1.', '5}']), { 'caf\u00e9': 'cr\u00e8me br\u00fbl\u00e9e', n: 1.5 });
+        deepEqual(parse(['["\u20ac", "a\\u00e9\u20ac', 'b\\n", 12', '3]']), ['\u20ac', 'a\u00e9\u20acb\n', 123]);
+        deepEqual(parse(['["\ud83d\ude00 x", "\u00e9"]']), ['\ud83d\ude00 x', '\u00e9']);
+        deepEqual(parse(['["a\ud83d', '\ude00", "\ud83d', '\ude00\ud83d', '\ude00"]']), ['a\ud83d\ude00', '\ud83d\ude00\ud83d\ude00']);
+        deepEqual(parse([new Buffer('["\u00e9', 'utf8'), '\u00e8\u20ac", "', new Buffer('\u00ea"]', 'utf8')]), ['\u00e9\u00e8\u20ac', '\u00ea']);
+    });
+
+    it('stats', function() {
+        var parser = ijson.createParser(function(result) {
+            return result;
+        }, 1);
+        parser.update('{"a": [1, 2.5, "x');
+        parser.update('"], "b": {"c": true, "d": nu');
+        parser.update('ll}}');
+        strictEqual(JSON.stringify(parser.result()), '{"a":[1,2.5,"x"],"b":{"c":true,"d":null}}');
+        var stats = parser.stats();
+        strictEqual(stats.bytes, 49);
+        strictEqual(stats.objects, 2);
+        strictEqual(stats.arrays, 1);
+        strictEqual(stats.strings, 1);
+        strictEqual(stats.numbers, 2);
+        strictEqual(stats.booleans, 1);
+        strictEqual(stats.nulls, 1);
+        strictEqual(stats.splitTokens, 1);
+        strictEqual(stats.bytesCopied, 1);
+        strictEqual(stats.maxDepth, 2);
+        strictEqual(stats.callbacks, 3);
+        strictEqual(typeof stats.callbackTime, 'number');
+    });
+
+    it('validate', function() {
+        strictEqual(ijson.validate('{"a": [1, 2.5, "x"], "b": {"c": true, "d": null}}'), true);
+        strictEqual(ijson.validate(new Buffer('["caf\u00e9", "\u20ac\ud83d\ude00"]', 'utf8')), true);
+        strictEqual(ijson.validate('{"a": [1, 2}'), false);
+        strictEqual(ijson.validate('[1] [2]'), false);
+        strictEqual(ijson.validate(new Buffer([0x5b, 0x22, 0xc3, 0x28, 0x22, 0x5d])), false);
+        strictEqual(ijson.validate(new Buffer([0x5b, 0x22, 0xed, 0xa0, 0x80, 0x22, 0x5d])), false);
+        ['-', '01', '-01', '1.', '1.e5', '.5', '-.5', '1e', '1e+', '1E-', '+1', '1.5.2', '1e5.5', '"a\tb"', '"a\u0001b"', '["a\rb"]'].forEach(function(str) {
+            strictEqual(ijson.validate(str), false, str);
+        });
+        ['0', '-0', '0.5', '-0.5e-3', '10', '1E+2', '0e0', '"a\\tb"', '"a b"'].forEach(function(str) {
+            strictEqual(ijson.validate(str), true, str);
+        });
+        var parser = ijson.createParser(undefined, undefined, { validateOnly: true });
+        parser.update(new Buffer([0x5b, 0x22, 0xe2, 0x82]));
+        parser.update(new Buffer([0xac, 0x22, 0x2c, 0x20, 0x31]));
+        parser.update(']');
+        strictEqual(parser.result(), true);
+    });
+
+    it('typed arrays', function() {
+        var parser = ijson.createParser(undefined, undefined, { typedArrays: true });
+        parser.update('{"t": [1, 2, -3], "v": [1.5, -2, 1e3], "m": [1, "a"], ');
+        parser.update('"e": [], "n": [[1, 2], [3.5]], "big": [3000000000, 1]}');
+        var result = parser.result();
+        strictEqual(result.t instanceof Int32Array, true);
+        deepEqual(Array.prototype.slice.call(result.t), [1, 2, -3]);
+        strictEqual(result.v instanceof Float64Array, true);
+        deepEqual(Array.prototype.slice.call(result.v), [1.5, -2, 1000]);
+        deepEqual(result.m, [1, 'a']);
+        deepEqual(result.e, []);
+        strictEqual(result.n[0] instanceof Int32Array, true);
+        strictEqual(result.n[1] instanceof Float64Array, true);
+        strictEqual(result.big instanceof Float64Array, true);
+    });
+
+    it('columnar', function() {
+        function parse(str) {
+            var parser = ijson.createParser(undefined, undefined, { columnar: true });
+            parser.update(str);
+            return parser.result();
+        }
+        var result = parse('[{"id": 1, "name": "a", "score": 1.5}, {"id": 2, "name": "b", "score": 3}]');
+        strictEqual(result.id instanceof Int32Array, true);
+        deepEqual(Array.prototype.slice.call(result.id), [1, 2]);
+        deepEqual(result.name, ['a', 'b']);
+        strictEqual(result.score instanceof Float64Array, true);
+        deepEqual(Array.prototype.slice.call(result.score), [1.5, 3]);
+        deepEqual(parse('[{"a": 1, "b": 2}, {"a": 3, "c": 4}]'), [{ a: 1, b: 2 }, { a: 3, c: 4 }]);
+        deepEqual(parse('[{"a": 1}, 2]'), [{ a: 1 }, 2]);
+        deepEqual(parse('{"x": [{"a": 1}]}'), { x: [{ a: 1 }] });
+    });
+
+    it('external strings', function() {
+        var big = new Array(2001).join('x');
+        var parser = ijson.createParser(undefined, undefined, { externalStrings: 1000 });
+        parser.update(new Buffer('{"a": "' + big + '", "b": "short", "c": "caf\u00e9' + big + '", "d": "' + big.slice(0, 500), 'utf8'));
+        // the strings do not reference the input buffers, which may be reused
+        var buf = new Buffer(big.slice(500) + '", "e": "' + big + '"}', 'utf8');
+        parser.update(buf);
+        buf.fill('z');
+        deepEqual(parser.result(), { a: big, b: 'short', c: 'caf\u00e9' + big, d: big, e: big });
+        strictEqual(parser.stats().externalStrings > 0, native);
+    });
+
+    it('json pointer', function() {
+        var index = ijson.index(new Buffer('{"a": {"b": [10, "x", {"c/d": true, "e~f": null}]}, "g": 1.5}', 'utf8'));
+        deepEqual(index.get(''), { a: { b: [10, 'x', { 'c/d': true, 'e~f': null }] }, g: 1.5 });
+        deepEqual(index.get('/a/b'), [10, 'x', { 'c/d': true, 'e~f': null }]);
+        strictEqual(index.get('/a/b/1'), 'x');
+        strictEqual(index.get('/a/b/2/c~1d'), true);
+        strictEqual(index.get('/a/b/2/e~0f'), null);
+        strictEqual(index.get('/g'), 1.5);
+        strictEqual(index.get('/a/b/3'), undefined);
+        strictEqual(index.get('/a/b/01'), undefined);
+        strictEqual(index.get('/x/y'), undefined);
+        strictEqual(index.get('/g/0'), undefined);
+        strictEqual(ijson.index(new Buffer('{"t": [1, 2]}'), { typedArrays: true }).get('/t') instanceof Int32Array, true);
+        var options = { ndjson: true, pauseAfter: 1, coalesce: 64 };
+        deepEqual(ijson.index(new Buffer('{"a": [1, 2], "b": {"c": "d"}}'), options).get('/a'), [1, 2]);
+        deepEqual(ijson.index(new Buffer('{"a": [1, 2], "b": {"c": "d"}}'), options).get('/b'), { c: 'd' });
+    });
+
+    it('parseMany', function() {
+        var results = ijson.parseMany([new Buffer('{"a": 1}'), '[true, "x"]', new Buffer('[1,'), '1, 2', ' 5 ']);
+        deepEqual(results.slice(0, 2), [{ a: 1 }, [true, 'x']]);
+        strictEqual(results[2] instanceof Error, true);
+        strictEqual(results[2].message, 'Unexpected end of input');
+        strictEqual(results[3] instanceof Error, true);
+        strictEqual(results[4], 5);
+        deepEqual(ijson.parseMany([]), []);
+    });
+
+    it('reset and pool', function() {
+        var parser = ijson.createParser();
+        parser.update('{"a": [1, {"b": ');
+        parser.reset();
+        parser.update('{"a": [1, {"b": 2}]}');
+        deepEqual(parser.result(), { a: [1, { b: 2 }] });
+        parser.reset();
+        parser.update('"x"');
+        strictEqual(parser.result(), 'x');
+        // frames of closed values are reused by the next update
+        parser.reset();
+        parser.update('[{"a": 1}');
+        parser.update(', [2, {"b": [3]}]');
+        parser.update(', {"c": 4}]');
+        deepEqual(parser.result(), [{ a: 1 }, [2, { b: [3] }], { c: 4 }]);
+        var pool = ijson.createPool(undefined, undefined, { typedArrays: true }, 1);
+        deepEqual(pool.parse('{"a": "b"}'), { a: 'b' });
+        strictEqual(pool.parse(new Buffer('[1, 2]')) instanceof Int32Array, true);
+        strictEqual(pool.idle.length, 1);
+        var p1 = pool.acquire();
+        var p2 = pool.acquire();
+        pool.release(p1);
+        pool.release(p2);
+        strictEqual(pool.idle.length, 1);
+        try {
+            pool.parse('[1,');
+        } catch (ex) {
+            strictEqual(ex.message, 'Unexpected end of input');
+        }
+        strictEqual(pool.parse('true'), true);
+    });
+
+    it('coalesce', function() {
+        var results = [];
+        var parser = ijson.createParser(function(value) {
+            results.push(value);
+        }, 1, { coalesce: 1000 });
+        var str = '[1, "ab\\ncd", {"e": true}, 2.5, ';
+        for (var i = 0; i < str.length; i += 3) parser.update(new Buffer(str.substring(i, i + 3)));
+        strictEqual(results.length, native ? 0 : 4);
+        parser.flush();
+        deepEqual(results, [1, 'ab\ncd', { e: true }, 2.5]);
+        strictEqual(parser.stats().coalesced, native ? Math.ceil(str.length / 3) : 0);
+        parser.update('null]');
+        deepEqual(results.slice(0, 5), [1, 'ab\ncd', { e: true }, 2.5, null]);
+        strictEqual(parser.result(), undefined);
+        // the first update after the delay parses the pending bytes
+        results = [];
+        parser = ijson.createParser(function(value) {
+            results.push(value);
+        }, 1, { coalesce: 1000, coalesceDelay: 5 });
+        parser.update(new Buffer('[1, '));
+        deepEqual(results, native ? [] : [1]);
+        var t0 = Date.now();
+        while (Date.now() - t0 < 10);
+        parser.update(new Buffer('2, '));
+        deepEqual(results, [1, 2]);
+        strictEqual(parser.stats().coalesced, native ? 2 : 0);
+    });
+    it('inflate', function() {
+        var zlib = require('zlib');
+        var doc = { a: [1, 2.5, 'x'], b: { c: null, d: 'caf\u00e9' } };
+        var gz = zlib.gzipSync(JSON.stringify(doc));
+        var parser = ijson.createParser(undefined, undefined, { inflate: true });
+        for (var i = 0; i < gz.length; i += 5) parser.update(gz.slice(i, i + 5));
+        deepEqual(parser.result(), doc);
+        strictEqual(parser.stats().compressedBytes, gz.length);
+        parser = ijson.createParser(undefined, undefined, { inflate: 'raw' });
+        parser.update(zlib.deflateRawSync('[1, 2]'));
+        deepEqual(parser.result(), [1, 2]);
+        parser = ijson.createParser(undefined, undefined, { inflate: true });
+        parser.update(gz.slice(0, gz.length - 4));
+        try {
+            parser.result();
+            strictEqual(true, false);
+        } catch (ex) {
+            strictEqual(ex.message, 'Unexpected end of compressed input');
+        }
+        deepEqual(ijson.parseMany([zlib.deflateSync('[3]'), gz], { inflate: true }), [[3], doc]);
+    });
+    it('key prediction', function() {
+        // records with a fixed key order: the keys of the first one are predicted, unless keyOrder gives them
+        var records = '[{"id": 1, "name": "a"}, {"id": 2, "name": "b"}, {"id": 3, "name": "c"}]';
+        // keys out of order, escaped, or missing: mispredicted keys are looked up
+        var str = '[{"id": 1, "name": "a"}, {"id": 2, "name": "b"}, {"name": "c", "id": 3}, {"id": 4, "x\\u0079": 5}, {"id": 6}]';
+        [[{}, 4, 3], [{ keyOrder: ['id', 'name'] }, 6, 5], [{ keyOrder: false }, 0, 0]].forEach(function(t) {
+            var parser = ijson.createParser(undefined, undefined, t[0]);
+            parser.update(new Buffer(records));
+            deepEqual(parser.result(), JSON.parse(records));
+            strictEqual(parser.stats().keyPredictions, native ? t[1] : 0);
+            parser = ijson.createParser(undefined, undefined, t[0]);
+            parser.update(new Buffer(str));
+            deepEqual(parser.result(), JSON.parse(str));
+            strictEqual(parser.stats().keyPredictions, native ? t[2] : 0);
+        });
+    });
+    it('pause', function() {
+        var str = '[1, "caf\u00e9", {"a": [2]}, null, 3]';
+        [str, new Buffer(str)].forEach(function(input) {
+            var parser = ijson.createParser(undefined, undefined, { pauseAfter: 2 });
+            var offsets = [];
+            for (var pos = 0; pos < input.length; offsets.push(pos)) pos = parser.update(input, pos);
+            strictEqual(offsets.length, 3);
+            strictEqual(input.slice(offsets[0], offsets[1]).toString(), ', {"a": [2]}, null');
+            deepEqual(parser.result(), [1, 'caf\u00e9', { a: [2] }, null, 3]);
+        });
+        var seen = [];
+        var parser = ijson.createParser(function(value) {
+            seen.push(value);
+            if (value === 'x') parser.pause();
+            return value;
+        }, 1);
+        var input = new Buffer('["x", "y"]');
+        var pos = parser.update(input);
+        deepEqual(seen, ['x']);
+        strictEqual(parser.update(input, pos), input.length);
+        deepEqual(parser.result(), ['x', 'y']);
+        // a string which comes after coalesced bytes waits until they have been parsed
+        seen = [];
+        parser = ijson.createParser(function(value) {
+            seen.push(value);
+            return value;
+        }, 1, { coalesce: 1000, pauseAfter: 1 });
+        [new Buffer('[1, "\u00e9", '), '"\u00e9\u20ac", 2, ', '"\u00e9", 3]'].forEach(function(input) {
+            for (var pos = 0; pos < input.length;) pos = parser.update(input, pos);
+        });
+        var expected = [1, '\u00e9', '\u00e9\u20ac', 2, '\u00e9', 3];
+        deepEqual(seen, expected.concat([expected]));
+        deepEqual(parser.result(), expected);
+        // buffers too
+        seen = [];
+        parser = ijson.createParser(function(value) {
+            seen.push(value);
+            return value;
+        }, 1, { coalesce: 8, pauseAfter: 1 });
+        var offsets = [];
+        [new Buffer('[10, 2'), new Buffer('0, 3'), new Buffer('0]')].forEach(function(input) {
+            for (var pos = 0; pos < input.length; offsets.push(pos)) pos = parser.update(input, pos);
+        });
+        deepEqual(offsets, native ? [6, 0, 4, 2] : [4, 6, 2, 4, 2]);
+        deepEqual(parser.result(), [10, 20, 30]);
+        // inflate: the inflated bytes after the pause are parsed by the next update() or by result()
+        var values = [];
+        for (var i = 0; i < 3000; i++) values.push(i);
+        seen = [];
+        parser = ijson.createParser(function(value) {
+            seen.push(value);
+            return value;
+        }, 1, { inflate: true, pauseAfter: 1000 });
+        var gz = require('zlib').gzipSync(JSON.stringify(values));
+        strictEqual(parser.update(gz), gz.length);
+        strictEqual(seen.length, native ? 1000 : 0);
+        deepEqual(parser.result(), values);
+        strictEqual(seen.length, 3001);
+    });
+    it('transforms', function() {
+        var str = '[{"id": "12", "at": "2020-01-31T12:00:00.5Z", "x": null, "tags": ["1", "a"]}, {"id": "b", "at": "2020-01-31", "x": 1}]';
+        var parser = ijson.createParser(undefined, undefined, { transforms: [
+            { path: '/*/id', number: true, rename: 'key' },
+            { path: '/*/at', date: true },
+            { dropNull: true }
+        ] });
+        parser.update(new Buffer(str));
+        var result = parser.result();
+        deepEqual(result, [{ key: 12, at: new Date(Date.UTC(2020, 0, 31, 12, 0, 0, 500)), tags: ['1', 'a'] }, { key: 'b', at: new Date(Date.UTC(2020, 0, 31)), x: 1 }]);
+        strictEqual(result[0].at instanceof Date, true);
+        strictEqual(parser.stats().transformed, 6);
+        deepEqual(ijson.parseMany(['["2020-01-31T12:00:00", "1e3"]'], { transforms: [{ date: true, number: true }] }), [['2020-01-31T12:00:00', 1000]]);
+    });
+    it('ndjson', function() {
+        var str = '{"a": 1}\n{"a": [2, }\n\n3\n[true, {"b": nul}]\n"x"';
+        var parser = ijson.createParser(undefined, undefined, { ndjson: true });
+        for (var i = 0; i < str.length; i += 4) parser.update(new Buffer(str.substring(i, i + 4)));
+        deepEqual(parser.result(), [{ a: 1 }, 3, 'x']);
+        deepEqual(parser.errors().map(function(err) {
+            return [err.line, err.offset];
+        }), [[2, 19], [5, 40]]);
+        deepEqual(parser.errors(), []);
+        strictEqual(parser.stats().syntaxErrors, 2);
+        // a cut last line is dropped, and offsets start again after reset()
+        parser.reset();
+        parser.update('1\n{"a": [2, {"b": 1');
+        deepEqual(parser.result(), [1]);
+        deepEqual(parser.errors(), [{ message: 'Unexpected end of input', line: 2, offset: 19 }]);
+        deepEqual(ijson.parseMany(['1\nx\n2', new Buffer('[1')], { ndjson: true }), [
+            { values: [1, 2], errors: [{ message: 'line 2: syntax error near x', line: 2, offset: 2 }] },
+            { values: [], errors: [{ message: 'Unexpected end of input', line: 1, offset: 2 }] },
+        ]);
+        // values completed on a bad line before its error are dropped with it
+        deepEqual(ijson.parseMany(['12x\n3\n', '12x\n{"a":1} x\n3\n', '1 2\n{"a":1}}\n3', '3\n1 [2'], { ndjson: true }).map(function(r) {
+            return [r.values, r.errors.length];
+        }), [[[3], 1], [[3], 2], [[3], 2], [[3], 1]]);
+        parser = ijson.createParser();
+        try {
+            parser.update('1\n2');
+            strictEqual(true, false);
+        } catch (ex) {
+            strictEqual(ex.message.indexOf('line 2: syntax error'), 0);
+        }
+    });
+
+    it('serializer', function() {
+        var value = { a: [1, 2.5, 'x"y\n', true, null], b: { 'caf\u00e9': '\u20ac' }, c: new Date(0), d: undefined };
+        var serializer = ijson.createSerializer(value);
+        var chunks = [];
+        var chunk;
+        while ((chunk = serializer.next(5)) !== null) {
+            strictEqual(chunk.length <= 5, true);
+            chunks.push(chunk);
+        }
+        strictEqual(Buffer.concat(chunks).toString('utf8'), JSON.stringify(value));
+        strictEqual(ijson.createSerializer(undefined).next(10), null);
+        // same output as JSON.stringify
+        var arr = [1, 2];
+        arr.toJSON = function() {
+            return 'arr';
+        };
+        [
+            [0.1, 1e-7, -1e-7, 1e21, 1e15, 123456789012345680000, -1.5e-10, 5e-324, 1.7976931348623157e308, 0.000001, 1.5e-6, 1 / 3, -0],
+            ['a\ud800b', '\udc01', '\ud83d\ude00', 'x\ud83d', '\u0000\u001f\u007f\u2028'],
+            { arr: arr, n: new Number(2.5), s: new String('s'), b: new Boolean(false), f: function() {}, u: undefined },
+        ].forEach(function(value) {
+            var serializer = ijson.createSerializer(value);
+            var chunks = [];
+            var chunk;
+            while ((chunk = serializer.next(7)) !== null) chunks.push(chunk);
+            strictEqual(Buffer.concat(chunks).toString('utf8'), JSON.stringify(value));
+        });
+    });
+
+    it('parseFile', function() {
+        var fs = require('fs');
+        var path = require('os').tmpdir() + '/ijson-test-' + process.pid + '.json';
+        var doc = [];
+        for (var i = 0; i < 50000; i++) doc.push({ id: i, s: 'x\ny'.repeat(i % 10) });
+        fs.writeFileSync(path, JSON.stringify(doc));
+        try {
+            deepEqual(ijson.parseFile(path), doc);
+            var count = 0;
+            var parser = ijson.createParser(function() {
+                count++;
+            }, 1);
+            parser.updateFile(path);
+            strictEqual(parser.result(), undefined);
+            strictEqual(count, doc.length + 1);
+        } finally {
+            fs.unlinkSync(path);
+        }
+    });
 });